@@ -0,0 +1,122 @@
+#include "ast.h"
+
+/**
+ * Direct subexpressions of a node, in evaluation order. Returned as pointers
+ * to the owning slots so that passes can replace subtrees in place.
+ *
+ * NB: a lambda's body is evaluated when it is called, not where it appears. A
+ * lazy lambda has no children until its body is parsed.
+ *
+ * @param node: node to examine.
+ * @return: slots holding the node's children.
+ */
+std::vector<std::unique_ptr<Node>*>
+children(Node& node)
+{
+	std::vector<std::unique_ptr<Node>*> result;
+
+	switch (node.type) {
+		case node_type::DEFINE:
+		case node_type::SET:
+			result.push_back(&node.cast<Assignment>()->value);
+			break;
+		case node_type::LAMBDA:
+			for (auto& expression : node.cast<Lambda>()->body) result.push_back(&expression);
+			break;
+		case node_type::IF: {
+			auto branch = node.cast<If>();
+			result.push_back(&branch->predicate);
+			result.push_back(&branch->consequent);
+			result.push_back(&branch->alternative);
+			}
+			break;
+		case node_type::AND:
+		case node_type::OR:
+			result.push_back(&node.cast<Logical>()->left);
+			result.push_back(&node.cast<Logical>()->right);
+			break;
+		case node_type::NOT:
+			result.push_back(&node.cast<Logical>()->left);
+			break;
+		case node_type::CALL: {
+			auto call = node.cast<Call>();
+			result.push_back(&call->callee);
+			for (auto& argument : call->arguments) result.push_back(&argument);
+			}
+			break;
+		case node_type::BEGIN:
+			for (auto& expression : node.cast<Sequence>()->body) result.push_back(&expression);
+			break;
+		default:
+			break;
+	}
+
+	return result;
+}
+
+/**
+ * Deep copy of a subtree. Optimization bookkeeping on lambdas is not copied,
+ * apart from the name the lambda is bound to.
+ *
+ * @param node: root of the subtree to copy.
+ * @return: the copy.
+ */
+std::unique_ptr<Node>
+clone(Node& node)
+{
+	switch (node.type) {
+		case node_type::CONSTANT:
+			return std::make_unique<Constant>(node.token, node.cast<Constant>()->value);
+		case node_type::SYMBOL:
+			return std::make_unique<Symbol>(node.token);
+		case node_type::DEFINE:
+		case node_type::SET: {
+			auto assignment = node.cast<Assignment>();
+			return std::make_unique<Assignment>(node.type, node.token, assignment->name,
+				clone(*assignment->value));
+			}
+		case node_type::LAMBDA: {
+			auto copy = std::make_unique<Lambda>(node.token);
+			copy->parameters = node.cast<Lambda>()->parameters;
+			copy->self = node.cast<Lambda>()->self;
+			copy->source = node.cast<Lambda>()->source;
+			copy->references = node.cast<Lambda>()->references;
+			copy->assigned = node.cast<Lambda>()->assigned;
+			for (auto& expression : node.cast<Lambda>()->body) {
+				copy->body.push_back(clone(*expression));
+			}
+			return copy;
+			}
+		case node_type::IF: {
+			auto branch = node.cast<If>();
+			auto copy = std::make_unique<If>(node.token);
+			copy->predicate = clone(*branch->predicate);
+			copy->consequent = clone(*branch->consequent);
+			copy->alternative = clone(*branch->alternative);
+			return copy;
+			}
+		case node_type::AND:
+		case node_type::OR:
+		case node_type::NOT: {
+			auto logical = node.cast<Logical>();
+			auto copy = std::make_unique<Logical>(node.type, node.token);
+			copy->left = clone(*logical->left);
+			if (logical->right) copy->right = clone(*logical->right);
+			return copy;
+			}
+		case node_type::CALL: {
+			auto call = node.cast<Call>();
+			auto copy = std::make_unique<Call>(node.token, clone(*call->callee));
+			for (auto& argument : call->arguments) copy->arguments.push_back(clone(*argument));
+			return copy;
+			}
+		case node_type::BEGIN: {
+			auto copy = std::make_unique<Sequence>(node.token);
+			for (auto& expression : node.cast<Sequence>()->body) {
+				copy->body.push_back(clone(*expression));
+			}
+			return copy;
+			}
+	}
+	return nullptr;
+}
@@ -0,0 +1,150 @@
+#ifndef LISP_AST_H
+#define LISP_AST_H
+
+#include "common.h"
+#include "scanner.h"
+#include "value.h"
+
+/**
+ * Expressions the parser produces. Special forms get their own node type;
+ * everything else is a constant, a symbol, or a call.
+ */
+enum class node_type
+{
+	CONSTANT, SYMBOL,
+	DEFINE, SET, LAMBDA, IF,
+	AND, OR, NOT,
+	CALL, BEGIN
+};
+
+/**
+ * Header shared by every node of the intermediate representation (an
+ * s-expression AST) that sits between the parser and bytecode generation.
+ * Optimization passes rewrite the tree in place before it is compiled.
+ */
+struct Node
+{
+	node_type type;
+	Token token;  // Used for error reporting - e.g. the variable being defined.
+	bool unused = false;  // Value discarded, with no side effects - see Compiler::drop.
+
+	/**
+	 * Convenience function for accessing the node containing this header.
+	 * Intended to be used with a LBYL strategy in conjunction with node_type.
+	 *
+	 * @return: this node, cast to T
+	 */
+	template <typename T>
+	T* cast() { return static_cast<T*>(this); }
+	virtual ~Node() = default;
+protected:
+	Node(node_type type, Token token) : type{ type }, token{ token } {}
+};
+
+/* Top-level expressions of a single REPL line, in order. */
+using Program = std::vector<std::unique_ptr<Node>>;
+
+/**
+ * Self-evaluating number, boolean, or nil.
+ */
+struct Constant : Node
+{
+	Value value;
+	Constant(Token token, Value value) : Node(node_type::CONSTANT, token), value{ value } {}
+};
+
+/**
+ * Reference to a variable - resolved to a local, upvalue, or global when the
+ * bytecode is generated.
+ */
+struct Symbol : Node
+{
+	std::string name;
+	Symbol(Token token) : Node(node_type::SYMBOL, token), name{ token.string } {}
+};
+
+/**
+ * Definition (type DEFINE) or assignment (type SET) of a variable.
+ */
+struct Assignment : Node
+{
+	std::string name;
+	std::unique_ptr<Node> value;
+	Assignment(node_type type, Token token, std::string name, std::unique_ptr<Node> value)
+		: Node(type, token), name{ name }, value{ std::move(value) } {}
+};
+
+/**
+ * Anonymous function - the result of the final body expression is returned.
+ * If constant folding relied on globals staying unchanged when optimizing the
+ * body, those globals are listed in 'assumptions' and the unoptimized lambda
+ * is kept in 'original' so that the function can be recompiled later.
+ *
+ * If the function is bound to a variable that is never reassigned, 'self' is
+ * its name - a tail call through it from the body can become a loop.
+ *
+ * A lazy lambda's body is not parsed until the function is first called -
+ * 'source' holds it instead, with the names it refers to (other than the
+ * parameters) and sets, as found by Parser::skip_body.
+ */
+struct Lambda : Node
+{
+	std::vector<Token> parameters;
+	Program body;
+	std::string self;
+	std::vector<std::string> assumptions;
+	std::unique_ptr<Lambda> original;
+	std::string source;
+	std::vector<Token> references;
+	std::vector<Token> assigned;
+	std::vector<bool> numbers;  // Parameters always bound to numbers - see Compiler::loop_types.
+	bool lazy() { return !source.empty(); }
+	Lambda(Token token) : Node(node_type::LAMBDA, token) {}
+};
+
+/**
+ * Lisp-style ternary if.
+ */
+struct If : Node
+{
+	std::unique_ptr<Node> predicate;
+	std::unique_ptr<Node> consequent;
+	std::unique_ptr<Node> alternative;
+	If(Token token) : Node(node_type::IF, token) {}
+};
+
+/**
+ * Short-circuit (type AND or OR) or logical NOT (type NOT, right is empty).
+ */
+struct Logical : Node
+{
+	std::unique_ptr<Node> left;
+	std::unique_ptr<Node> right;
+	Logical(node_type type, Token token) : Node(type, token) {}
+};
+
+/**
+ * Call to a builtin or user-defined function.
+ */
+struct Call : Node
+{
+	std::unique_ptr<Node> callee;
+	std::vector<std::unique_ptr<Node>> arguments;
+	Call(Token token, std::unique_ptr<Node> callee)
+		: Node(node_type::CALL, token), callee{ std::move(callee) } {}
+};
+
+/**
+ * Expressions evaluated in order for the value of the last one (nil if there
+ * are none). Not part of the syntax - loop forms are rewritten to use it.
+ */
+struct Sequence : Node
+{
+	Program body;
+	Sequence(Token token) : Node(node_type::BEGIN, token) {}
+};
+
+std::vector<std::unique_ptr<Node>*> children(Node& node);
+std::unique_ptr<Node> clone(Node& node);
+
+#endif
@@ -0,0 +1,2 @@
+(define sum (lambda (n acc) (if (= n 0) acc (sum (- n 1) (+ acc (- (+ n n) (+ n 1)))))))
+(sum 2000000 0)
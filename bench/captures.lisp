@@ -0,0 +1,3 @@
+(define make (lambda (a b) (lambda (n) (let loop ((i n) (acc 0)) (if (= i 0) acc (loop (- i 1) (+ acc (* a b))))))))
+(define sum (make 2 3))
+(sum 3000000)
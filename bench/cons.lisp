@@ -0,0 +1,4 @@
+(define build (lambda (n acc) (if (= n 0) 0 (build (- n 1) (cons n acc)))))
+(build 200000 nil)
+(define pairs (lambda (n acc) (if (= n 0) 0 (pairs (- n 1) (cons (cons n n) (cons acc nil))))))
+(pairs 200000 nil)
@@ -0,0 +1,2 @@
+(define countdown (lambda (n) (if (= n 0) 0 (countdown (- n 1)))))
+(countdown 3000000)
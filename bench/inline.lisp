@@ -0,0 +1,4 @@
+(define square (lambda (x) (* x x)))
+(define norm (lambda (x y) (+ (square x) (square y))))
+(define run (lambda (n acc) (if (= n 0) acc (let ((d (norm n 1))) (run (- n 1) (+ acc (- d (* n n))))))))
+(run 1000000 0)
@@ -0,0 +1,3 @@
+(define apply1 (lambda (f x) (f x)))
+(define loop (lambda (n acc) (if (= n 0) acc (loop (- n 1) (apply1 (lambda (x) (+ x 1)) acc)))))
+(loop 1000000 0)
@@ -0,0 +1,2 @@
+(let sum ((i 0) (acc 0)) (if (= i 3000000) acc (sum (+ i 1) (+ acc i))))
+(do ((i 0 (+ i 1)) (acc 0 (+ acc i))) ((= i 3000000) acc))
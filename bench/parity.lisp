@@ -0,0 +1,3 @@
+(define iseven (lambda (n) (if (= n 0) true (isodd (- n 1)))))
+(define isodd (lambda (n) (if (= n 0) false (iseven (- n 1)))))
+(iseven 3000000)
@@ -0,0 +1,54 @@
+#!/bin/sh
+# Build the interpreter in each configuration and time it on each program.
+#
+# Usage: bench/run.sh [program.lisp ...]
+#
+# Each program is run RUNS times per configuration and the best time is shown.
+# Configurations are compiled with -DNDEBUG so that tracing and GC logging
+# don't dominate the measurement. CXX and CXXFLAGS can be overridden.
+
+cd "$(dirname "$0")/.." || exit 1
+
+CXX=${CXX:-g++}
+CXXFLAGS=${CXXFLAGS:-"-std=c++20 -O2"}
+BUILD=${BUILD:-$(mktemp -d)}
+RUNS=${RUNS:-3}
+
+# name:flags - flags are added to CXXFLAGS for that configuration.
+CONFIGS="
+switch:-DDISABLE_COMPUTED_GOTO
+threaded:
+nanbox:-DNAN_BOXING
+"
+
+if [ $# -eq 0 ]; then
+	set -- bench/*.lisp
+fi
+
+for config in $CONFIGS; do
+	name=${config%%:*}
+	flags=$(echo "${config#*:}" | tr ',' ' ')
+	echo "building $name"
+	$CXX $CXXFLAGS -DNDEBUG $flags -o "$BUILD/$name" *.cpp || exit 1
+done
+
+printf '%-20s' "program"
+for config in $CONFIGS; do printf '%12s' "${config%%:*}"; done
+printf '\n'
+
+for program in "$@"; do
+	printf '%-20s' "$(basename "$program")"
+	for config in $CONFIGS; do
+		name=${config%%:*}
+		best=
+		for run in $(seq "$RUNS"); do
+			start=$(date +%s.%N)
+			"$BUILD/$name" < "$program" > /dev/null 2>&1
+			end=$(date +%s.%N)
+			best=$(awk -v s="$start" -v e="$end" -v b="$best" \
+				'BEGIN { t = e - s; print (b == "" || t < b) ? t : b }')
+		done
+		printf '%11.3fs' "$best"
+	done
+	printf '\n'
+done
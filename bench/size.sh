@@ -0,0 +1,73 @@
+#!/bin/sh
+# Report the bytecode size of each program, and the effect of the compact
+# encoding (see PeepholeOptimizer::compact) on size and run time.
+#
+# Usage: bench/size.sh [program.lisp ...]
+#
+# Sizes are totals over every function compiled, as reported by --code-size.
+# Times are the best of RUNS runs at -O2, with and without the compact pass
+# ("uncompact").
+# If perf is installed, L1 instruction cache misses are shown as well.
+
+cd "$(dirname "$0")/.." || exit 1
+
+CXX=${CXX:-g++}
+CXXFLAGS=${CXXFLAGS:-"-std=c++20 -O2"}
+BUILD=${BUILD:-$(mktemp -d)}
+RUNS=${RUNS:-3}
+
+if [ $# -eq 0 ]; then
+	set -- bench/*.lisp
+fi
+
+echo "building"
+$CXX $CXXFLAGS -DNDEBUG -o "$BUILD/lisp" *.cpp || exit 1
+
+# Bytes of bytecode after the last pass: size <program> <options...>
+size() {
+	program=$1
+	shift
+	"$BUILD/lisp" --code-size "$@" < "$program" 2>&1 > /dev/null | tail -n 1 | awk '{ print $2 }'
+}
+
+# Best time over RUNS runs: best <program> <options...>
+best() {
+	program=$1
+	shift
+	best=
+	for run in $(seq "$RUNS"); do
+		start=$(date +%s.%N)
+		"$BUILD/lisp" "$@" < "$program" > /dev/null 2>&1
+		end=$(date +%s.%N)
+		best=$(awk -v s="$start" -v e="$end" -v b="$best" \
+			'BEGIN { t = e - s; print (b == "" || t < b) ? t : b }')
+	done
+	echo "$best"
+}
+
+# L1 instruction cache misses, or "-" without perf: misses <program> <options...>
+misses() {
+	program=$1
+	shift
+	if ! command -v perf > /dev/null; then
+		echo "-"
+		return
+	fi
+	perf stat -x , -e L1-icache-load-misses "$BUILD/lisp" "$@" < "$program" 2>&1 > /dev/null |
+		awk -F , '/L1-icache-load-misses/ { print $1 }'
+}
+
+printf '%-20s%10s%10s%12s%10s%12s%14s%14s\n' "program" "-O0" "-O2" "uncompact" \
+	"time" "uncompact" "icache-miss" "uncompact"
+
+for program in "$@"; do
+	printf '%-20s' "$(basename "$program")"
+	printf '%10s' "$(size "$program" -O0)"
+	printf '%10s' "$(size "$program")"
+	printf '%12s' "$(size "$program" --disable-pass=compact)"
+	printf '%9.3fs' "$(best "$program")"
+	printf '%11.3fs' "$(best "$program" --disable-pass=compact)"
+	printf '%14s' "$(misses "$program")"
+	printf '%14s' "$(misses "$program" --disable-pass=compact)"
+	printf '\n'
+done
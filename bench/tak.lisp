@@ -0,0 +1,3 @@
+(define lt (lambda (a b) (if (= a b) false (if (= b 0) false (if (= a 0) true (lt (- a 1) (- b 1)))))))
+(define tak (lambda (x y z) (if (not (lt y x)) z (tak (tak (- x 1) y z) (tak (- y 1) z x) (tak (- z 1) x y)))))
+(tak 22 12 6)
@@ -1,21 +1,35 @@
 #include "bytecode.h"
 #include "value.h"
+#include "function.h"
 
 /**
-* Add a Value constant and return its index.
+* Add a Value constant and return its index. The caller checks that the index
+* fits in an operand.
 * 
 * @param constant : store this Value in the constant table
 * @return : index in constant table
 */
-uint16_t
+size_t
 Chunk::add_constant(Value const constant)
 {
-	// TODO: check for UINT16_MAX?
 	constants.push_back(constant);
-	return static_cast<uint16_t>(constants.size() - 1);
+	return constants.size() - 1;
 };
 
 
+/**
+ * Add an empty feedback entry for a new call site and return its index.
+ * 
+ * @param arguments: number of arguments passed at the call site.
+ * @return: index in call site table.
+ */
+size_t
+Chunk::add_call_site(uint16_t arguments)
+{
+	call_sites.push_back(CallSite{ .arguments = arguments });
+	return call_sites.size() - 1;
+}
+
 // TODO: revise newline handling.
 /**
  * Write an opcode or other 8-bit integer to this chunk and record its line.
@@ -36,6 +50,38 @@ Chunk::write(uint8_t op, size_t line)
 	}
 };
 
+/**
+ * Remove all bytecode and constants, e.g. before compiling a function again.
+ */
+void
+Chunk::clear()
+{
+	instructions.clear();
+	constants.clear();
+	newlines.clear();
+	call_sites.clear();
+	max_line = 0;
+}
+
+/**
+ * Remove the bytecode written from an offset onwards, along with the constants
+ * and call sites added since, e.g. code whose value turns out to be unused. A
+ * line starting in the removed code starts at the next byte written instead.
+ *
+ * @param length: number of bytes of bytecode to keep.
+ * @param constant_count: number of constants to keep.
+ * @param call_site_count: number of call sites to keep.
+ */
+void
+Chunk::truncate(size_t length, size_t constant_count, size_t call_site_count)
+{
+	if (std::find(newlines.begin() + length, newlines.end(), true) != newlines.end()) max_line = 0;
+	instructions.resize(length);
+	newlines.resize(length);
+	constants.erase(constants.begin() + constant_count, constants.end());
+	call_sites.erase(call_sites.begin() + call_site_count, call_sites.end());
+}
+
 /**
  * Used during garbage collection to help determine memory cost of bytecode.
  * 
@@ -48,5 +94,207 @@ Chunk::vector_size()
 	total += instructions.capacity() * sizeof(uint8_t);
 	total += constants.capacity() * sizeof(Value);
 	total += newlines.capacity() / 8;
+	total += call_sites.capacity() * sizeof(CallSite);
 	return total;
+}
+
+/**
+ * Length of an instruction, including its operands.
+ * 
+ * @param offset: location of instruction in bytecode.
+ * @return: number of bytes used by the instruction.
+ */
+size_t
+Chunk::instruction_length(size_t offset)
+{
+	switch (instructions[offset]) {
+		case opcode::CONSTANT:
+		case opcode::DEFINE_GLOBAL:
+		case opcode::GET_GLOBAL:
+		case opcode::SET_GLOBAL:
+		case opcode::GET_LOCAL:
+		case opcode::SET_LOCAL:
+		case opcode::GET_UPVALUE:
+		case opcode::SET_UPVALUE:
+		case opcode::GET_CAPTURED:
+		case opcode::JUMP:
+		case opcode::JUMP_IF_FALSE:
+		case opcode::JUMP_IF_TRUE:
+		case opcode::LOOP:
+		case opcode::END_SCOPE:
+		// Calls take a call site index - see CallSite::arguments.
+		case opcode::CALL:
+		case opcode::TAIL_CALL:
+		case opcode::CALL0:
+		case opcode::CALL1:
+		case opcode::CALL2:
+		case opcode::CALL3:
+		case opcode::CALL_CLOSURE:
+		case opcode::CALL_BUILTIN:
+		case opcode::CALL_SAME_FUNCTION:
+		case opcode::POP_GET_LOCAL:
+		case opcode::POP_GET_GLOBAL:
+		case opcode::JUMP_IF_FALSE_POP:
+			return 3;
+		case opcode::GET_LOCAL_CONSTANT:
+		case opcode::GET_LOCAL_LOCAL:
+		case opcode::GET_GLOBAL_LOCAL:
+			return 5;
+		case opcode::GET_LOCAL_SHORT:
+		case opcode::GET_GLOBAL_SHORT:
+		case opcode::CONSTANT_SHORT:
+		case opcode::SMALL_INT:
+			return 2;
+		case opcode::CLOSURE: {
+			// Each captured variable adds a capture flags byte and a uint16 index.
+			auto function = constants[operand(offset)].as_data()->cast<Function>();
+			return 3 + 3 * (function->upvalues + function->captures);
+			}
+		case opcode::WIDE: {
+			// Opcode, then the instruction's operands - each two bytes longer.
+			if (instructions[offset + 1] != opcode::CLOSURE) return 6;
+			auto function = constants[operand(offset)].as_data()->cast<Function>();
+			return 6 + 5 * (function->upvalues + function->captures);
+			}
+		default:
+			return 1;
+	}
+}
+
+/**
+ * @param offset: location of instruction in bytecode.
+ * @return: opcode of the instruction, after any WIDE prefix.
+ */
+uint8_t
+Chunk::instruction_op(size_t offset)
+{
+	if (instructions[offset] == opcode::WIDE) return instructions[offset + 1];
+	return instructions[offset];
+}
+
+/**
+ * Read the first operand of an instruction - a uint32 after a WIDE prefix,
+ * otherwise a uint16. Both are little-endian.
+ *
+ * @param offset: location of instruction in bytecode.
+ * @return: value of the operand.
+ */
+size_t
+Chunk::operand(size_t offset)
+{
+	if (instructions[offset] != opcode::WIDE) {
+		return instructions[offset + 2] * 256 + instructions[offset + 1];
+	}
+	size_t value = 0;
+	for (size_t byte = 4; byte > 0; byte--) value = value * 256 + instructions[offset + 1 + byte];
+	return value;
+}
+
+/**
+ * Determine the most stack slots this bytecode can use beyond the slots
+ * holding the called closure and its arguments. Used so that the VM can check
+ * for stack overflow once per call rather than on every push.
+ * 
+ * NB: jumps are forward-only, so a single linear pass is sufficient - the
+ * depth at a jump target is recorded when the jump is seen, as the code just
+ * before the target may end with a RETURN instead of falling through. The one
+ * backward jump, LOOP, goes to the start of the function with only the
+ * arguments on the stack, and needs no more space than the first pass did.
+ * 
+ * @return: maximum stack depth reached by this bytecode.
+ */
+size_t
+Chunk::max_stack_depth()
+{
+	size_t depth = 0;
+	size_t max_depth = 0;
+	std::unordered_map<size_t, size_t> target_depths;
+
+	for (size_t offset = 0; offset < instructions.size();) {
+		auto target = target_depths.find(offset);
+		if (target != target_depths.end()) depth = target->second;
+
+		size_t length = instruction_length(offset);
+		switch (instruction_op(offset)) {  // WIDE only changes the operand size.
+			case opcode::JUMP:
+			case opcode::JUMP_IF_FALSE:
+			case opcode::JUMP_IF_TRUE:
+				target_depths[offset + length + operand(offset)] = depth;
+				break;
+			case opcode::JUMP_IF_FALSE_POP:
+				target_depths[offset + length + operand(offset)] = depth;
+				--depth;
+				break;
+			case opcode::GET_LOCAL_CONSTANT:
+			case opcode::GET_LOCAL_LOCAL:
+			case opcode::GET_GLOBAL_LOCAL:
+				depth += 2;
+				break;
+			case opcode::END_SCOPE:
+				depth -= operand(offset);
+				break;
+			case opcode::CONSTANT:
+			case opcode::TRUE:
+			case opcode::FALSE:
+			case opcode::NIL:
+			case opcode::GET_GLOBAL:
+			case opcode::GET_LOCAL:
+			case opcode::GET_UPVALUE:
+			case opcode::GET_CAPTURED:
+			case opcode::CLOSURE:
+			case opcode::GET_LOCAL_0:
+			case opcode::GET_LOCAL_1:
+			case opcode::GET_LOCAL_2:
+			case opcode::GET_LOCAL_3:
+			case opcode::GET_LOCAL_SHORT:
+			case opcode::GET_GLOBAL_SHORT:
+			case opcode::CONSTANT_SHORT:
+			case opcode::SMALL_INT:
+				++depth;
+				break;
+			case opcode::ADD:
+			case opcode::SUBTRACT:
+			case opcode::MULTIPLY:
+			case opcode::EQUAL:
+			case opcode::LESS:
+			case opcode::GREATER:
+			case opcode::ADD_NUMBERS:
+			case opcode::SUBTRACT_NUMBERS:
+			case opcode::MULTIPLY_NUMBERS:
+			case opcode::EQUAL_NUMBERS:
+			case opcode::LESS_NUMBERS:
+			case opcode::GREATER_NUMBERS:
+				// Falling back to a call inserts the callee under both
+				// arguments, briefly using one slot more than on entry.
+				if (depth + 1 > max_depth) max_depth = depth + 1;
+				--depth;
+				break;
+			case opcode::CONS:
+			case opcode::DEFINE_GLOBAL:
+			case opcode::SET_GLOBAL:
+			case opcode::SET_LOCAL:
+			case opcode::SET_UPVALUE:
+			case opcode::RETURN:
+			case opcode::POP:
+				--depth;
+				break;
+			case opcode::CALL:
+			case opcode::TAIL_CALL:
+			case opcode::CALL0:
+			case opcode::CALL1:
+			case opcode::CALL2:
+			case opcode::CALL3:
+			case opcode::CALL_CLOSURE:
+			case opcode::CALL_BUILTIN:
+			case opcode::CALL_SAME_FUNCTION: {
+				size_t site = instructions[offset + 2] * 256 + instructions[offset + 1];
+				depth -= call_sites[site].arguments;
+				}
+				break;
+		}
+		if (depth > max_depth) max_depth = depth;
+		offset += length;
+	}
+
+	return max_depth;
 }
\ No newline at end of file
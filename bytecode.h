@@ -4,6 +4,7 @@
 #include "common.h"
 
 struct Value;
+struct Data;
 
 /* Using a typed enum in a namespace over an enum class here because the goal
  * of this enum is to function as a labeling system for 8-bit integer opcodes
@@ -13,16 +14,80 @@ namespace opcode
 	enum opcode : uint8_t
 	{
 		CONSTANT, TRUE, FALSE, NIL,
-		ADD, NOT, EQUAL, CONS,
+		ADD, SUBTRACT, MULTIPLY, NOT,
+		EQUAL, LESS, GREATER, CONS,
 		DEFINE_GLOBAL, GET_GLOBAL, SET_GLOBAL,
 		GET_LOCAL, SET_LOCAL,
-		GET_UPVALUE, SET_UPVALUE,
+		GET_UPVALUE, SET_UPVALUE, GET_CAPTURED,
 		RETURN, POP,
-		JUMP, JUMP_IF_FALSE,
-		CALL, TAIL_CALL, CLOSURE,
+		JUMP, JUMP_IF_FALSE, JUMP_IF_TRUE, LOOP,
+		CALL, TAIL_CALL, CLOSURE, END_SCOPE,
+		// Calls with the number of arguments implied by the opcode.
+		CALL0, CALL1, CALL2, CALL3,
+		// Quickened forms of calls, rewritten in place by the VM.
+		CALL_CLOSURE, CALL_BUILTIN, CALL_SAME_FUNCTION,
+		// Superinstructions - common pairs fused by the optimizer.
+		GET_LOCAL_CONSTANT, GET_LOCAL_LOCAL, GET_GLOBAL_LOCAL,
+		POP_GET_LOCAL, POP_GET_GLOBAL, JUMP_IF_FALSE_POP,
+		// Compact forms with implied, 8-bit or immediate operands.
+		GET_LOCAL_0, GET_LOCAL_1, GET_LOCAL_2, GET_LOCAL_3,
+		GET_LOCAL_SHORT, GET_GLOBAL_SHORT, CONSTANT_SHORT, SMALL_INT,
+		// Operators whose operands are known to be numbers - see Compiler::numeric.
+		ADD_NUMBERS, SUBTRACT_NUMBERS, MULTIPLY_NUMBERS,
+		EQUAL_NUMBERS, LESS_NUMBERS, GREATER_NUMBERS,
+		// Prefix - the next instruction's operands are uint32, not uint16.
+		WIDE,
+		OPCODE_COUNT  // Not an opcode - size of dispatch table.
 	};
 }
 
+/* Flags in the byte before the index of each variable a CLOSURE captures. */
+namespace capture
+{
+	constexpr uint8_t LOCAL = 1;  // In the enclosing frame, not its closure.
+	constexpr uint8_t COPY = 2;  // Copied into the closure, not a shared upvalue.
+}
+
+enum class call_site_state
+{
+	UNINITIALIZED, MONOMORPHIC, POLYMORPHIC, MEGAMORPHIC
+};
+
+/**
+ * Feedback recorded by the VM for a single call site - an inline cache of the
+ * callees it has seen, and the types of the arguments passed to each of them.
+ * Once more than CACHE_SIZE callees are seen the site is megamorphic and stops
+ * recording new ones. NB: a quickened call site records nothing until its
+ * guard fails, so counts are a lower bound.
+ */
+struct CallSite
+{
+	static constexpr size_t CACHE_SIZE = 4;
+	static constexpr size_t TYPED_ARGUMENTS = 4;  // Leading arguments tracked.
+
+	struct Entry {
+		Data* target = nullptr;  // Function of a called closure, or a builtin.
+		bool closure = false;
+		uint64_t count = 0;
+		// Bit (1 << value_type) set for each type seen per argument.
+		uint8_t argument_types[TYPED_ARGUMENTS] = {};
+	};
+
+	uint16_t arguments;  // Number of arguments passed at this call site.
+	Entry entries[CACHE_SIZE] = {};
+	size_t size = 0;
+	bool megamorphic = false;
+
+	/**
+	 * @return: how many distinct callees this site has seen.
+	 */
+	call_site_state state() const {
+		if (megamorphic) return call_site_state::MEGAMORPHIC;
+		if (size == 0) return call_site_state::UNINITIALIZED;
+		return size == 1 ? call_site_state::MONOMORPHIC : call_site_state::POLYMORPHIC;
+	}
+};
+
 /**
  * Bytecode chunk with associated data to handle constant lookups, debugging.
  */
@@ -35,17 +100,25 @@ public:
 	std::vector<uint8_t> instructions;
 	std::vector<Value> constants;
 	std::vector<bool> newlines;  // TODO: replace
+	std::vector<CallSite> call_sites;  // Indexed by the operand of each call.
 	Chunk(size_t line) : base_line{ line } {};
-	uint16_t add_constant(Value constant);
+	size_t add_constant(Value constant);
+	size_t add_call_site(uint16_t arguments);
 	void write(uint8_t op, size_t line);
+	void clear();
+	void truncate(size_t length, size_t constant_count, size_t call_site_count);
 	size_t vector_size();
+	size_t instruction_length(size_t offset);
+	uint8_t instruction_op(size_t offset);
+	size_t operand(size_t offset);
+	size_t max_stack_depth();
 	void optimize_if_tail_call(const size_t call_index) {
-		for (size_t i = call_index + 3; i < instructions.size();) {
+		for (size_t i = call_index + instruction_length(call_index); i < instructions.size();) {
 			switch (instructions[i]) {
 			case opcode::RETURN:
 				instructions[call_index] = opcode::TAIL_CALL;
 				return;
-			case opcode::JUMP: {
+			case opcode::JUMP: {  // A WIDE jump ends the search - they are rare.
 					uint8_t constant = instructions[i + 1];
 					uint8_t overflow = instructions[i + 2];
 					constexpr size_t jump = 3;
@@ -58,8 +131,9 @@ public:
 		}
 	}
 	void tail_call_optimize() {
-		for (size_t i = 0; i < instructions.size(); i++) {
-			if (instructions[i] == opcode::CALL) {
+		for (size_t i = 0; i < instructions.size(); i += instruction_length(i)) {
+			if (instructions[i] == opcode::CALL ||
+				(instructions[i] >= opcode::CALL0 && instructions[i] <= opcode::CALL3)) {
 				// Optimize true/false branches.
 				optimize_if_tail_call(i);
 			}
@@ -1,20 +1,41 @@
 #ifndef LISP_COMMON_H
 #define LISP_COMMON_H
 
+// Debug output is on by default - build with -DNDEBUG to disable it.
+#ifndef NDEBUG
 #define DEBUG_BYTECODE_ERRORS
 #define DEBUG_TRACE_EXECUTION
 #define DEBUG_LOG_GC
+#endif
 //#define DEBUG_STRESS_GC
 
+// Count how often each opcode is followed by each other opcode at runtime, and
+// report the most frequent pairs on exit - used to choose superinstructions.
+//#define PROFILE_OPCODE_PAIRS
+
+// Pack Values into a single NaN-boxed 64-bit word instead of a tagged union.
+//#define NAN_BOXING
+
+// Direct-threaded dispatch (labels as values) is used when the compiler
+// supports it. Build with -DDISABLE_COMPUTED_GOTO to use the portable switch.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(DISABLE_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
 #include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <bit>
 #include <iomanip>
 #include <iostream>
 #include <vector>
 #include <string>
-#include <forward_list>
 #include <unordered_map>
-#include <any>
+#include <unordered_set>
 #include <memory>
 #include <queue>
+#include <type_traits>
 
 #endif
\ No newline at end of file
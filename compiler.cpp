@@ -1,72 +1,280 @@
 #include "compiler.h"
-#include "scanner.h"
 
-/* Future design note - definition_or_expression is a legacy of when this was
- * a more Scheme-like Lisp dialect. It's similar to expression() and
- * parse_next(), and these should be refactored. I'm moving to definitions
- * being expressions that return NIL. */
+/**
+ * Collect the names a subtree assigns to. Shadowing is ignored, so this errs
+ * on the side of including a name. The unoptimized AST of a lambda counts as
+ * well, as the lambda is compiled from it again if an assumption fails, and so
+ * do the names set in the unparsed body of a lazy lambda.
+ *
+ * @param node: subtree to search, including nested lambdas.
+ * @param names: set to add the symbol of each name to.
+ */
+static void
+assignments(Node& node, std::unordered_set<size_t>& names)
+{
+	if (node.type == node_type::SET) names.insert(node.token.symbol);
+	if (node.type == node_type::LAMBDA) {
+		for (auto& name : node.cast<Lambda>()->assigned) names.insert(name.symbol);
+	}
+	if (node.type == node_type::LAMBDA && node.cast<Lambda>()->original) {
+		assignments(*node.cast<Lambda>()->original, names);
+	}
+	for (auto child : children(node)) assignments(**child, names);
+}
 
+/**
+ * Does a subtree refer to a name at all? Like assignments, this includes the
+ * unoptimized AST and unparsed body of each lambda.
+ *
+ * @param node: subtree to search, including nested lambdas.
+ * @param symbol: symbol of the name (see intern).
+ * @return: is the name referred to, set, or defined?
+ */
+static bool
+mentions(Node& node, size_t symbol)
+{
+	bool named = node.type == node_type::SYMBOL || node.type == node_type::SET ||
+		node.type == node_type::DEFINE;
+	if (named && node.token.symbol == symbol) return true;
+	if (node.type == node_type::LAMBDA) {
+		auto& lambda = *node.cast<Lambda>();
+		for (auto& reference : lambda.references) {
+			if (reference.symbol == symbol) return true;
+		}
+		if (lambda.original && mentions(*lambda.original, symbol)) return true;
+	}
+	for (auto child : children(node)) {
+		if (mentions(**child, symbol)) return true;
+	}
+	return false;
+}
 
-// TODO: refactor into stack
 /**
- * Compile the source and return the top-level function.
- * 
- * @return: shared pointer to top-level function.
+ * Is a name only ever called, with a number of arguments, by code compiled in
+ * the same function? Lambdas that are inlined (see Compiler::inline_call)
+ * are part of that function, but the name can't appear in any other lambda.
+ *
+ * @param node: subtree to search.
+ * @param symbol: symbol of the name (see intern).
+ * @param arity: number of arguments each call must pass.
+ * @return: is every use of the name the callee of such a call?
  */
-std::shared_ptr<Function>
-Compiler::compile()
+static bool
+only_called(Node& node, size_t symbol, size_t arity)
 {
-	locals.push_back(Local{
-		.token = Token{.type = token_type::BEGIN, .line = 0 },
-		.depth = 0});
+	switch (node.type) {
+		case node_type::SYMBOL:
+			return node.token.symbol != symbol;
+		case node_type::DEFINE:
+		case node_type::SET:
+			if (node.token.symbol == symbol) return false;
+			break;
+		case node_type::LAMBDA:
+			return !mentions(node, symbol);
+		case node_type::CALL: {
+			auto& call = *node.cast<Call>();
+			for (auto& argument : call.arguments) {
+				if (!only_called(*argument, symbol, arity)) return false;
+			}
+			if (call.callee->type == node_type::SYMBOL && call.callee->token.symbol == symbol) {
+				return call.arguments.size() == arity;
+			}
+			if (call.callee->type != node_type::LAMBDA) return only_called(*call.callee, symbol, arity);
+			auto callee = call.callee->cast<Lambda>();
+			if (callee->lazy() || callee->original || callee->parameters.size() != call.arguments.size()) {
+				return only_called(*call.callee, symbol, arity);
+			}
+			for (auto& expression : callee->body) {
+				if (!only_called(*expression, symbol, arity)) return false;
+			}
+			return true;
+			}
+		default:
+			break;
+	}
+	for (auto child : children(node)) {
+		if (!only_called(**child, symbol, arity)) return false;
+	}
+	return true;
+}
+
+/**
+ * Match the AST Parser::loop builds for a named let or do, as optimized:
+ * ((lambda () (define name function) name) values...), where the function
+ * calls itself by name, and only does so in its own body.
+ *
+ * @param node: AST for a call.
+ * @return: the loop's function (if matched) or nullptr (otherwise).
+ */
+static Lambda*
+loop_function(Call& node)
+{
+	if (node.callee->type != node_type::CALL) return nullptr;
+	auto& scope = *node.callee->cast<Call>();
+	if (scope.callee->type != node_type::LAMBDA || !scope.arguments.empty()) return nullptr;
+	auto& body = scope.callee->cast<Lambda>()->body;
+	if (!scope.callee->cast<Lambda>()->parameters.empty() || body.size() != 2) return nullptr;
+	if (body[0]->type != node_type::DEFINE || body[1]->type != node_type::SYMBOL) return nullptr;
+
+	size_t symbol = body[1]->token.symbol;
+	auto& value = body[0]->cast<Assignment>()->value;
+	if (body[0]->token.symbol != symbol || value->type != node_type::LAMBDA) return nullptr;
+	auto function = value->cast<Lambda>();
+	if (function->lazy() || function->self != body[1]->cast<Symbol>()->name) return nullptr;
+	if (function->parameters.size() != node.arguments.size()) return nullptr;
 
-	advance();
-	while (scanner.current.type != token_type::END) {
-		definition_or_expression();
-		if (scanner.current.type != token_type::END) write(opcode::POP);
+	for (auto& parameter : function->parameters) {
+		if (parameter.symbol == symbol) return nullptr;
 	}
-	write(opcode::RETURN);
-#ifdef DEBUG_BYTECODE_ERRORS
-	if (!had_error) {
-		disassembleBytecode(function->bytecode, "CODE");
+	for (auto& expression : function->body) {
+		if (!only_called(*expression, symbol, node.arguments.size())) return nullptr;
 	}
-#endif
+	return function;
+}
+
+/**
+ * @param op: opcode of an operator (see VirtualMachine::primitive_opcode).
+ * @return: opcode for the operator when both operands are numbers.
+ */
+static uint8_t
+number_opcode(int op)
+{
+	switch (op) {
+		case opcode::ADD: return opcode::ADD_NUMBERS;
+		case opcode::SUBTRACT: return opcode::SUBTRACT_NUMBERS;
+		case opcode::MULTIPLY: return opcode::MULTIPLY_NUMBERS;
+		case opcode::EQUAL: return opcode::EQUAL_NUMBERS;
+		case opcode::LESS: return opcode::LESS_NUMBERS;
+		default: return opcode::GREATER_NUMBERS;
+	}
+}
+
+/**
+ * Compile a REPL line and return the top-level function.
+ *
+ * @param program: AST for each top-level expression, already optimized.
+ * @return: pointer to top-level function, or nullptr if there was an error.
+ */
+Function*
+Compiler::compile(Program& program)
+{
+	for (auto& expression : program) assignments(*expression, assigned);
+	body(program);
+	finish("CODE");
 	return had_error ? nullptr : function;
 }
 
 /**
- * Move forward one token. Retain previous token in case it is needed to parse
- * current token. Contains under-construction error strategy - idea is to
- * support recovery to the next non-error statement if possible.
+ * Compile a sequence of expressions followed by a return. If a forward jump
+ * turns out to be too far for a uint16 offset, the body is compiled again
+ * with every forward jump taking a uint32 offset. Likewise if a parameter
+ * assumed to hold a number is passed something else (see self_call), until
+ * the assumptions hold.
+ *
+ * @param expressions: expressions to compile, in order.
  */
 void
-Compiler::advance()
+Compiler::body(Program& expressions)
 {
-	// TODO: reset panic mode at next definition or expression?
-	for (;;) {  // If an error is encountered, go to next non-error token.
-		scanner.advance();
-		if (scanner.current.type != token_type::ERROR) break;
-		error("Unrecognized token " + scanner.current.string, scanner.current);
+	size_t parameters = locals.size();
+	sequence(expressions, true);
+	write(opcode::RETURN);
+
+	while ((jump_overflow || retype) && !had_error) {
+		function->bytecode.clear();  // Functions compiled for lambdas are garbage.
+		numbers.clear();
+		remove_locals(parameters);
+		stack_depth = parameters;
+		wide_jumps = wide_jumps || jump_overflow;
+		jump_overflow = false;
+		retype = false;
+		dropped = 0;
+		sequence(expressions, true);
+		write(opcode::RETURN);
 	}
 }
 
 /**
- * Advance one token if it is what is expected or indicate an error otherwise.
- * 
- * @param expected: next token type required.
- * @param error_message: error message if token is not expected type.
+ * Compile a sequence of expressions - only the result of the final expression
+ * is kept. An empty sequence results in nil. Unused expressions are left out,
+ * and so is an unused definition, other than its value of nil.
+ *
+ * @param expressions: expressions to compile, in order.
+ * @param tail: is the sequence's value returned from the function?
  */
 void
-Compiler::consume(token_type expected, std::string error_message)
+Compiler::sequence(Program& expressions, bool tail)
 {
-	if (scanner.current.type == expected) advance();
-	else error(error_message, scanner.current);
+	if (expressions.empty()) write(opcode::NIL);
+
+	for (size_t i = 0; i < expressions.size(); i++) {
+		bool last = i + 1 == expressions.size();
+		if (expressions[i]->unused) {
+			dropped += drop(*expressions[i]);
+			if (last) write(opcode::NIL);
+			dropped += last ? -1 : 1;  // The NIL written instead, or the POP left out.
+			continue;
+		}
+		expression(*expressions[i], tail && last);
+		if (!last) write(opcode::POP);
+	}
+}
+
+/**
+ * Compile an expression, then remove its code - it has no side effects and its
+ * value is unused (see Node::unused). It is compiled all the same so that the
+ * function has the upvalues it would have with the code, as it may be compiled
+ * again from an AST where the expression is kept (see Lambda::original).
+ *
+ * @param node: AST for the expression.
+ * @return: number of bytes removed.
+ */
+size_t
+Compiler::drop(Node& node)
+{
+	auto& bytecode = function->bytecode;
+	size_t length = bytecode.instructions.size();
+	size_t constant_count = bytecode.constants.size();
+	size_t call_site_count = bytecode.call_sites.size();
+	size_t base = locals.size();
+	size_t depth = stack_depth;
+
+	expression(node);
+
+	size_t removed = bytecode.instructions.size() - length;
+	bytecode.truncate(length, constant_count, call_site_count);
+	std::erase_if(numbers, [&](auto& entry) { return entry.second >= constant_count; });
+	remove_locals(base);
+	stack_depth = depth;
+	return removed;
+}
+
+/**
+ * Run the bytecode passes over the finished function and record the stack
+ * space it needs.
+ *
+ * @param name: label for the disassembly (debug builds only).
+ */
+void
+Compiler::finish([[maybe_unused]] std::string name)
+{
+	std::string label = scope_depth == 0 ? "top level" : self.empty() ? "lambda" : self;
+	vm.optimizer().run(*function, label, dropped);
+	function->upvalues = 0;
+	function->captures = 0;
+	for (auto& upvalue : upvalues) (upvalue.copied ? function->captures : function->upvalues)++;
+	function->stack_size = function->bytecode.max_stack_depth();
+#ifdef DEBUG_BYTECODE_ERRORS
+	if (!had_error) {
+		disassembleBytecode(function->bytecode, name);
+	}
+#endif
 }
 
 /**
  * Display error to user and indicate to compiler that program is invalid,
  * preventing the program from being run by the VM.
- * 
+ *
  * @param error_message: message to display to user.
  * @param token: token where error was encountered.
  */
@@ -80,17 +288,15 @@ Compiler::error(std::string error_message, Token token)
 	panic_mode = true;
 }
 
-// TODO: synchronize
-
 /**
  * Write bytecode for the specified uint8.
- * 
+ *
  * @param op: opcode or other uint8 to write.
  */
 void
 Compiler::write(uint8_t op)
 {
-	function->bytecode.write(op, scanner.previous.line);
+	function->bytecode.write(op, line);
 }
 
 /**
@@ -107,16 +313,53 @@ Compiler::write_uint16(uint16_t uint)
 	write(overflow);
 }
 
+/**
+ * Write bytecode for the specified uint32 as four uint8 in little-endian order.
+ *
+ * @param uint: uint32 to write in little-endian order.
+ */
+void
+Compiler::write_uint32(uint32_t uint)
+{
+	for (size_t byte = 0; byte < 4; byte++) write(static_cast<uint8_t>(uint >> (8 * byte)));
+}
+
+/**
+ * Write an instruction with an index operand - a uint16 if the index fits,
+ * otherwise a uint32 after a WIDE prefix.
+ *
+ * @param op: opcode to write.
+ * @param operand: index to write.
+ */
+void
+Compiler::write_operand(uint8_t op, size_t operand)
+{
+	if (operand > UINT16_MAX) {
+		write(opcode::WIDE);
+		write(op);
+		write_uint32(static_cast<uint32_t>(operand));
+		return;
+	}
+	write(op);
+	write_uint16(static_cast<uint16_t>(operand));
+}
+
 /**
  * Used with patch_jump - this writes the jump instruction, reserves space for
  * the constant part of the instruction, and returns index of the constant.
- * 
+ *
  * @param jump: jump instruction to write.
  * @return: index of the constant part of the jump instruction.
  */
 size_t
 Compiler::write_jump(uint8_t jump)
 {
+	if (wide_jumps) {
+		write(opcode::WIDE);
+		write(jump);
+		write_uint32(UINT32_MAX);  // Will be overwritten by patch_jump
+		return function->bytecode.instructions.size() - 4;
+	}
 	write(jump); // TODO: verify valid jump opcode?
 	write(255);  // Will be overwritten by patch_jump
 	write(255);
@@ -125,18 +368,26 @@ Compiler::write_jump(uint8_t jump)
 
 /**
  * Update the placeholder bytecode written by write_jump to add jump target.
- * 
+ *
  * @param patch_index: first index of the index part of the jump instruction.
  */
 void
 Compiler::patch_jump(size_t patch_index)
 {
-	// error if not a valid size_t
+	auto& instructions = function->bytecode.instructions;
+	if (wide_jumps) {
+		size_t jump_to = instructions.size() - patch_index - 4;
+		for (size_t byte = 0; byte < 4; byte++) {
+			instructions[patch_index + byte] = static_cast<uint8_t>(jump_to >> (8 * byte));
+		}
+		return;
+	}
 
 	// Number of indices to jump forward (past jump instruction at minimum).
-	size_t jump_to = function->bytecode.instructions.size() - patch_index - 2;
-	
-	// error if > uint16t max
+	size_t jump_to = instructions.size() - patch_index - 2;
+
+	// Too far - body() starts again with wide jumps.
+	if (jump_to > UINT16_MAX) jump_overflow = true;
 
 	auto uint16_offset = static_cast<uint16_t>(jump_to);
 
@@ -144,32 +395,100 @@ Compiler::patch_jump(size_t patch_index)
 	auto overflow = static_cast<uint8_t>(uint16_offset >> 8);
 
 	// Update integer part of jump instruction (little-endian format).
-	function->bytecode.instructions[patch_index] = offset;
-	function->bytecode.instructions[patch_index + 1] = overflow;
+	instructions[patch_index] = offset;
+	instructions[patch_index + 1] = overflow;
 }
 
 /**
  * Write a constant Value. Updates bytecode constants vector.
- * 
+ *
  * @param value: Value of constant.
  */
 void
 Compiler::constant(Value value)
 {
-	uint16_t index = function->bytecode.add_constant(value);
-	write(opcode::CONSTANT);
-	write_uint16(index);
+	if (value.match_type(value_type::NIL)) {
+		write(opcode::NIL);
+		return;
+	}
+	if (value.match_type(value_type::BOOL)) {
+		write(value.as_boolean() ? opcode::TRUE : opcode::FALSE);
+		return;
+	}
+
+	write_operand(opcode::CONSTANT, make_constant(value));
 }
 
-// TODO: break out into integer and double versions.
 /**
- * Interpret the current token as a decimal and add it as a constant. Updates
- * bytecode constants vector.
+ * Add a Value to the constant table and return its index. A number already in
+ * the table is reused - numbers match if their bits do, so 0 and -0 differ.
+ *
+ * @param value: Value of constant.
+ * @return: index in the constant table.
+ */
+size_t
+Compiler::make_constant(Value value)
+{
+	bool number = value.match_type(value_type::NUMBER);
+	uint64_t bits = number ? std::bit_cast<uint64_t>(value.as_number()) : 0;
+	if (number) {
+		auto found = numbers.find(bits);
+		if (found != numbers.end()) return found->second;
+	}
+
+	size_t index = function->bytecode.add_constant(value);
+	if (number) numbers[bits] = index;
+	return index;
+}
+
+/**
+ * Compile an expression, leaving its value on the stack.
+ *
+ * @param node: AST for the expression.
+ * @param tail: is the expression's value returned from the function?
  */
 void
-Compiler::number()
+Compiler::expression(Node& node, bool tail)
 {
-	constant(std::stod(scanner.previous.string));
+	line = node.token.line;
+
+	switch (node.type) {
+		case node_type::CONSTANT:
+			constant(node.cast<Constant>()->value);
+			break;
+		case node_type::SYMBOL:
+			symbol(*node.cast<Symbol>());
+			break;
+		case node_type::DEFINE:
+			definition(*node.cast<Assignment>());
+			write(opcode::NIL);  // TODO: consider moving this to definition
+			break;
+		case node_type::SET:
+			set(*node.cast<Assignment>());
+			write(opcode::NIL);
+			break;
+		case node_type::LAMBDA:
+			lambda(*node.cast<Lambda>());
+			break;
+		case node_type::IF:
+			_if(*node.cast<If>(), tail);
+			break;
+		case node_type::AND:
+			_and(*node.cast<Logical>());
+			break;
+		case node_type::OR:
+			_or(*node.cast<Logical>());
+			break;
+		case node_type::NOT:
+			_not(*node.cast<Logical>());
+			break;
+		case node_type::CALL:
+			call(*node.cast<Call>(), tail);
+			break;
+		case node_type::BEGIN:
+			sequence(node.cast<Sequence>()->body, tail);
+			break;
+	}
 }
 
 // TODO: consider making this a built-in function
@@ -177,9 +496,9 @@ Compiler::number()
  * Implements logical NOT function.
  */
 void
-Compiler::_not()
+Compiler::_not(Logical& node)
 {
-	parse_next();
+	expression(*node.left);
 	write(opcode::NOT);
 }
 
@@ -188,12 +507,12 @@ Compiler::_not()
  * statement will only be evaluated if first does not evaluate to false.
  */
 void
-Compiler::_and()
+Compiler::_and(Logical& node)
 {
-	parse_next();
+	expression(*node.left);
 	size_t jump_to_exit = write_jump(opcode::JUMP_IF_FALSE);
 	write(opcode::POP);
-	parse_next();  // TODO: verify this is boolean?
+	expression(*node.right);  // TODO: verify this is boolean?
 	patch_jump(jump_to_exit);
 	// Temp - convert to bool
 	write(opcode::NOT);
@@ -205,198 +524,301 @@ Compiler::_and()
  * statement will only be evaluated if first evaluates to false.
  */
 void
-Compiler::_or()
+Compiler::_or(Logical& node)
 {
-	parse_next();
+	expression(*node.left);
 	size_t jump_to_second = write_jump(opcode::JUMP_IF_FALSE);
 	size_t jump_to_exit = write_jump(opcode::JUMP);
 	patch_jump(jump_to_second);
 	write(opcode::POP);
-	parse_next();  // TODO: verify this is boolean?
+	expression(*node.right);  // TODO: verify this is boolean?
 	patch_jump(jump_to_exit);
 	// Temp - convert to bool
 	write(opcode::NOT);
 	write(opcode::NOT);
 }
 
-// TODO: refactor expression, parse_next, and definition_or_expression.
-/**
- * NB: this function is currently a placeholder, but will have a role in thunk
- * resolution when I implement tail recursion and synchronization after error
- * after next compiler output pass.
- */
-void
-Compiler::definition_or_expression()
-{
-	expression();
-	// TODO: resolve thunks here?
-	// TODO: synchronize after error
-}
-
 // TODO: revise for let as needed (basically as a lambda)
 /**
  * Compile a global or local definition (depending on scope depth). Does not
  * allow variable redefinition.
  */
 void
-Compiler::definition()
+Compiler::definition(Assignment& node)
 {
-	consume(token_type::SYMBOL, "Expect symbol.");
-
 	if (scope_depth > 0) {
-		for (int i = locals.size() - 1; i >= 0; i--) {
-			if (locals[i].depth < scope_depth) break;
-			if (scanner.previous.string == locals[i].token.string)
-				error("Unexpected variable redefinition", scanner.previous);
-		}
+		int shadowed = resolve_local(node.token.symbol);
+		if (shadowed >= 0 && locals[shadowed].depth == static_cast<int>(scope_depth))
+			error("Unexpected variable redefinition", node.token);
 
-		Local local{ .token = scanner.previous,
-					 .depth = static_cast<int>(scope_depth)};
-		locals.push_back(local);
-		expression();  // Needs to be tested
+		add_local(Local{ .token = node.token,
+						 .depth = static_cast<int>(scope_depth),
+						 .slot = stack_depth,
+						 .initialized = false });
+		size_t index = locals.size() - 1;
+		expression(*node.value);  // Needs to be tested
+		locals[index].number = vm.optimizer().infer_types() && numeric(*node.value) &&
+			!assigned.contains(node.token.symbol);
+		locals[index].initialized = true;
+		stack_depth++;
 	}
 
 	else {
-		if (vm.check_global(scanner.previous.string)) {
-			error("Unexpected variable redefinition", scanner.previous);
+		if (vm.check_global(node.name)) {
+			error("Unexpected variable redefinition", node.token);
 			return;
 		}
 
-		size_t index = vm.global(scanner.previous.string);
-		expression();
-		write(opcode::DEFINE_GLOBAL);
-		write_uint16(index);
+		size_t index = vm.global(node.name);
+		expression(*node.value);
+		write_operand(opcode::DEFINE_GLOBAL, index);
 	}
 }
 
 void
-Compiler::set()
+Compiler::set(Assignment& node)
 {
-	consume(token_type::SYMBOL, "Expect symbol.");
-
-	int local = resolve_local(scanner.previous);
+	int local = resolve_local(node.token.symbol);
 	if (local >= 0) {
-		size_t index = local;
-		expression();
-		write(opcode::SET_LOCAL);
-		write_uint16(index);
+		size_t index = locals[local].slot;
+		expression(*node.value);
+		write_operand(opcode::SET_LOCAL, index);
 	}
 
-	else if ((local = resolve_upvalue(scanner.previous)) != -1) {
-		size_t index = local;
-		expression();
-		write(opcode::SET_UPVALUE);
-		write_uint16(index);
+	else if ((local = resolve_upvalue(node.token.symbol)) != -1) {
+		size_t index = upvalues[local].index;  // Never copied, as the name is assigned.
+		expression(*node.value);
+		write_operand(opcode::SET_UPVALUE, index);
 	}
 
-	else if (vm.check_global(scanner.previous.string)) {
-		size_t index = vm.global(scanner.previous.string);
-		expression();
-		write(opcode::SET_GLOBAL);
-		write_uint16(index);
+	else if (vm.check_global(node.name)) {
+		size_t index = vm.global(node.name);
+		expression(*node.value);
+		write_operand(opcode::SET_GLOBAL, index);
 	}
 
 	else {
-		error("Attempt to set undefined variable", scanner.previous);
+		error("Attempt to set undefined variable", node.token);
 	}
 }
 
-// TODO: write a "let" based on this.
 // TOOD: non-anonymous functions (similar to this - possible modification).
 /**
  * Compile an anonymous function - function body is similar to the top-level
  * script as a whole. Result of final expression is returned.
+ *
+ * A function that captures no variables gets a single closure, created here
+ * and loaded as a constant, rather than a new closure each time.
+ *
+ * The body of a lazy lambda is compiled on the function's first call instead.
  */
 void
-Compiler::lambda()
+Compiler::lambda(Lambda& node)
 {
 	Compiler compiler(this);
+	if (node.lazy()) compiler.defer_body(node);
+	else compiler.function_body(node);
 
-	// TODO: prevent redundant params
+	if (compiler.had_error) error("Error compiling function", node.token);
 
-	compiler.consume(token_type::LPAREN, "Expected '(' before function parameters");
-	while (scanner.current.type != token_type::RPAREN) {
-		compiler.consume(token_type::SYMBOL, "Expect symbol parameter");
+	line = node.token.line;
+	if (compiler.upvalues.empty()) {
+		constant(Value(vm.allocate<Closure>(compiler.function)));
+		return;
+	}
 
-		for (auto& local : compiler.locals) {
-			if (local.token.string == scanner.previous.string) {
-				compiler.error("Unexpected duplicate token",
-							   scanner.previous);
-			}
-		}
+	// A WIDE prefix makes the index of each captured variable a uint32 too.
+	size_t index = make_constant(Value(compiler.function));
+	bool wide = index > UINT16_MAX;
+	for (auto& upvalue : compiler.upvalues) wide = wide || upvalue.stack_index > UINT16_MAX;
+
+	if (wide) write(opcode::WIDE);
+	write(opcode::CLOSURE);
+	if (wide) write_uint32(static_cast<uint32_t>(index));
+	else write_uint16(static_cast<uint16_t>(index));
+
+	for (auto& upvalue : compiler.upvalues) {
+		write((upvalue.is_local ? capture::LOCAL : 0) | (upvalue.copied ? capture::COPY : 0));
+		if (wide) write_uint32(static_cast<uint32_t>(upvalue.stack_index));
+		else write_uint16(static_cast<uint16_t>(upvalue.stack_index));
+	}
+}
 
-		compiler.locals.push_back(Local{.token = scanner.previous,
-			.depth=static_cast<int>(compiler.scope_depth)});
-		compiler.function->arity++;
+/**
+ * Compile the parameters and body of a function into this compiler's function.
+ * If folding the body relied on globals being unchanged, the function is
+ * recorded so that it can be recompiled.
+ *
+ * @param node: AST for the function.
+ */
+void
+Compiler::function_body(Lambda& node)
+{
+	for (auto& parameter : node.parameters) {
+		add_local(Local{.token = parameter,
+			.depth=static_cast<int>(scope_depth), .slot = stack_depth++});
+		function->arity++;
 	}
-	compiler.consume(token_type::RPAREN, "Expected ')' after function parameters");
-	while (scanner.current.type != token_type::RPAREN && scanner.current.type != token_type::END) {
-		compiler.definition_or_expression();
-		if (scanner.current.type != token_type::RPAREN && scanner.current.type != token_type::END)
-			compiler.write(opcode::POP);
+
+	self = node.self;
+	line = node.token.line;
+	assignments(node, assigned);
+	for (size_t i = 0; i < node.numbers.size(); i++) {
+		locals[i].number = node.numbers[i] && !assigned.contains(node.parameters[i].symbol);
 	}
-	compiler.write(opcode::RETURN);
-	compiler.function->bytecode.tail_call_optimize();
+	body(node.body);
+	finish("FUNCTION CODE");
 
-	if (compiler.had_error) error("Error compiling function", scanner.previous);
-#ifdef DEBUG_BYTECODE_ERRORS
-	else {
-		disassembleBytecode(compiler.function->bytecode, "FUNCTION CODE");
+	if (node.original && !had_error) {
+		std::vector<std::string> captured;
+		std::vector<bool> copied;
+		for (auto& upvalue : upvalues) {
+			captured.push_back(upvalue.name);
+			copied.push_back(upvalue.copied);
+		}
+		vm.optimizer().constants().depend(function, node, captured, copied);
 	}
-#endif
+}
 
-	write(opcode::CLOSURE);
-	
-	uint16_t index = function->bytecode.add_constant(vm.allocate(compiler.function));
-	write_uint16(index);
+/**
+ * Set up the function to be compiled on its first call (see VirtualMachine::
+ * compile_lazy). Its upvalues are resolved from the names the body refers to,
+ * so that closures can be created before then.
+ *
+ * @param node: lazy lambda for the function.
+ */
+void
+Compiler::defer_body(Lambda& node)
+{
+	for (auto& reference : node.references) resolve_upvalue(reference.symbol);
+
+	auto lazy = LazyFunction{ .node = std::make_unique<Lambda>(node.token) };
+	lazy.node->parameters = node.parameters;
+	lazy.node->self = node.self;
+	lazy.node->assumptions = node.assumptions;
+	lazy.node->source = node.source;
+	for (auto& upvalue : upvalues) {
+		lazy.captured.push_back(upvalue.name);
+		lazy.copied.push_back(upvalue.copied);
+	}
+
+	function->arity = node.parameters.size();
+	function->upvalues = upvalues.size() - captures;
+	function->captures = captures;
+	function->lazy = true;
+	vm.defer(function, std::move(lazy));
+}
+
+/**
+ * Replace the bytecode of an existing function by compiling it again, e.g.
+ * after an assumption made when optimizing it no longer holds, or compile the
+ * body of a lazy function. Upvalues keep their kind and indexes, so closures
+ * already created remain valid.
+ *
+ * @param vm: VM the function belongs to.
+ * @param function: function to replace the bytecode of.
+ * @param node: AST for the function.
+ * @param captured: names of the function's upvalues, in order.
+ * @param copied: whether each upvalue was copied into the closure.
+ * @return: was the function compiled without errors?
+ */
+bool
+Compiler::recompile(VirtualMachine& vm, Function* function, Lambda& node,
+	const std::vector<std::string>& captured, const std::vector<bool>& copied)
+{
+	function->arity = 0;
+	function->lazy = false;
+	function->bytecode.clear();
+
+	Compiler compiler(vm, function);
+	for (size_t i = 0; i < captured.size(); i++) {
+		compiler.push_upvalue(i, false, captured[i], intern(captured[i]), copied[i]);
+	}
+	compiler.function_body(node);
+	return !compiler.had_error;
+}
+
+/**
+ * Add a local in the next slot of locals, hiding any local with the same name.
+ *
+ * @param local: local to add.
+ */
+void
+Compiler::add_local(Local local)
+{
+	auto [entry, added] = local_indexes.try_emplace(local.token.symbol, locals.size());
+	if (!added) {
+		local.shadowed = entry->second;
+		entry->second = static_cast<int>(locals.size());
+	}
+	locals.push_back(local);
+}
 
-	compiler.function->upvalues = compiler.upvalues.size();
-	for (size_t i = 0; i < compiler.function->upvalues; i++) {
-		write(compiler.upvalues[i].is_local ? 1 : 0);
-		write_uint16(compiler.upvalues[i].stack_index);
+/**
+ * Remove the locals from an index onwards, e.g. at the end of their scope.
+ * Any locals they hid are visible again.
+ *
+ * @param base: index of the first local to remove.
+ */
+void
+Compiler::remove_locals(size_t base)
+{
+	for (size_t i = locals.size(); i > base; i--) {
+		auto& local = locals[i - 1];
+		if (local.shadowed >= 0) local_indexes[local.token.symbol] = local.shadowed;
+		else local_indexes.erase(local.token.symbol);
 	}
+	locals.erase(locals.begin() + base, locals.end());
 }
 
 /**
- * Return index of a local Value or report if not found.
- * 
- * @param token: Token value of local to search for.
+ * Return index of the innermost local with a name or report if not found.
+ *
+ * @param symbol: symbol of the name to search for (see intern).
  * @return: index of local (if found) or -1 (otherwise).
  */
 int
-Compiler::resolve_local(Token token)
+Compiler::resolve_local(size_t symbol)
 {
-	// TODO: rewrite with hashmap?
-	for (int i = locals.size() - 1; i >= 0; i--) {
-		// Intended behavior: get from closest initialized scope.
-		if (token.string == locals[i].token.string && locals[i].depth >= 0)
-			return i;
-	}
-	return -1;
+	auto entry = local_indexes.find(symbol);
+	return entry == local_indexes.end() ? -1 : entry->second;
 }
 
 /**
- * Attempt to locate the stack index associated with this token by walking the
- * scopes recursively. This is slow during compile time but enables fast value
- * lookups during runtime.
- * 
- * @param token: Token value to search for.
- * @return: stack index (if found) or -1 (otherwise).
+ * Attempt to locate the stack index associated with this name by walking the
+ * enclosing compilers recursively, which enables fast value lookups during
+ * runtime. Each compiler looks the name up in its own tables.
+ *
+ * A variable that already has its value when the closure is created, and that
+ * is never assigned to afterwards, is copied into the closure. Only variables
+ * that may change are shared through a runtime upvalue.
+ *
+ * @param symbol: symbol of the name to search for (see intern).
+ * @return: index in upvalues vector (if found) or -1 (otherwise).
  */
 int
-Compiler::resolve_upvalue(Token token)
+Compiler::resolve_upvalue(size_t symbol)
 {
+	auto entry = upvalue_indexes.find(symbol);
+	if (entry != upvalue_indexes.end()) return entry->second;
 	if (this->enclosing == nullptr) return -1;
 
-	int local = this->enclosing->resolve_local(token);
+	int local = this->enclosing->resolve_local(symbol);
 	if (local >= 0) {
-		this->enclosing->locals[local].captured = true;
-		return push_upvalue(local, true);
+		auto& variable = this->enclosing->locals[local];
+		bool copied = variable.initialized && !this->enclosing->assigned.contains(symbol);
+		if (!copied) variable.captured = true;
+		int index = push_upvalue(variable.slot, true, variable.token.string, symbol, copied);
+		upvalues[index].number = variable.number;
+		return index;
 	}
 
-	int upvalue = this->enclosing->resolve_upvalue(token);
+	int upvalue = this->enclosing->resolve_upvalue(symbol);
 	if (upvalue >= 0) {
-		return push_upvalue(upvalue, false);		
+		auto& variable = this->enclosing->upvalues[upvalue];
+		int index = push_upvalue(variable.index, false, variable.name, symbol, variable.copied);
+		upvalues[index].number = variable.number;
+		return index;
 	}
 
 	return -1;
@@ -405,29 +827,56 @@ Compiler::resolve_upvalue(Token token)
 /**
  * Add upvalue if needed (with the corresponding stack index) and return its
  * index in the compiler's vector of upvalues for this scope.
- * 
- * @param stack_index: index in runtime stack associated with this upvalue.
- * @param local: is this value local to this scope?
+ *
+ * @param stack_index: index in runtime stack associated with this upvalue, or
+ *                     in the enclosing closure's upvalues or captures.
+ * @param local: is this value local to the enclosing scope?
+ * @param name: name of the captured variable.
+ * @param symbol: symbol of the name (see intern).
+ * @param copied: is the value copied into the closure rather than shared?
  * @return: index (in upvalues vector) of this upvalue.
  */
 int
-Compiler::push_upvalue(int stack_index, bool local)
+Compiler::push_upvalue(int stack_index, bool local, const std::string& name, size_t symbol,
+	bool copied)
 {
 	if (stack_index < 0) return -1;
 
-	for (size_t i = 0; i < upvalues.size(); i++) {
-		if (upvalues[i].stack_index == stack_index && upvalues[i].is_local) {
-			return i;
-		}
-	}
+	auto [entry, added] = upvalue_indexes.try_emplace(symbol, static_cast<int>(upvalues.size()));
+	if (!added) return entry->second;
 
 	// TODO: function?
 	upvalues.push_back(Upvalue{
 		.stack_index = static_cast<size_t>(stack_index),
-		.is_local = local
+		.is_local = local,
+		.name = name,
+		.symbol = symbol,
+		.copied = copied,
+		.index = copied ? captures : upvalues.size() - captures  // Among upvalues of the same kind.
 		});
+	if (copied) captures++;
 
-	return static_cast<int>(upvalues.size() - 1);
+	return entry->second;
+}
+
+/**
+ * Check whether this name refers to a global operator with its own opcode,
+ * i.e. one that is not shadowed by a local in this or any enclosing scope.
+ *
+ * @param name: token of the name to search for.
+ * @return: opcode implementing the operator (if found) or -1 (otherwise).
+ */
+int
+Compiler::resolve_primitive(const Token& name)
+{
+	int op = vm.primitive_opcode(name.string);
+	if (op < 0) return -1;
+
+	for (Compiler* compiler = this; compiler != nullptr; compiler = compiler->enclosing) {
+		if (compiler->resolve_local(name.symbol) >= 0) return -1;
+		if (compiler->upvalue_indexes.contains(name.symbol)) return -1;
+	}
+	return op;
 }
 
 /**
@@ -436,51 +885,56 @@ Compiler::push_upvalue(int stack_index, bool local)
  * shadowed.
  */
 void
-Compiler::symbol()
+Compiler::symbol(Symbol& node)
 {
-	int local = resolve_local(scanner.previous);
+	int local = resolve_local(node.token.symbol);
 	if (local >= 0) {
-		size_t index = local;
-		write(opcode::GET_LOCAL);
-		write_uint16(index);
+		write_operand(opcode::GET_LOCAL, locals[local].slot);
 	}
 
-	else if ((local = resolve_upvalue(scanner.previous)) != -1) {
-		size_t index = local;
-		write(opcode::GET_UPVALUE);
-		write_uint16(index);
+	else if ((local = resolve_upvalue(node.token.symbol)) != -1) {
+		auto& upvalue = upvalues[local];
+		write_operand(upvalue.copied ? opcode::GET_CAPTURED : opcode::GET_UPVALUE, upvalue.index);
 	}
-	
+
 	else {
-		size_t index = vm.global(scanner.previous.string);
-		write(opcode::GET_GLOBAL);
-		write_uint16(index);
+		write_operand(opcode::GET_GLOBAL, vm.global(node.name));
 	}
 }
 
-// TODO: refactor expression, parse_next, and definition_or_expression.
-void
-Compiler::expression()
-{
-	parse_next();
-}
-
 /**
- * Implements a Lisp-style ternary if with short-circuit evaluation.
+ * Implements a Lisp-style ternary if with short-circuit evaluation. With a
+ * constant predicate, only the branch taken is kept.
  */
 void
-Compiler::_if()
+Compiler::_if(If& node, bool tail)
 {
-	expression();  // predicate - value will be popped in either branch	
+	if (node.predicate->type == node_type::CONSTANT && vm.optimizer().dead_code()) {
+		Value predicate = node.predicate->cast<Constant>()->value;
+		bool truth = !predicate.match_type(value_type::BOOL) || predicate.as_boolean();
+		// Along with the predicate, both jumps and both POPs are left out.
+		dropped += drop(*node.predicate) + 2 * (wide_jumps ? 6 : 3) + 2;
+		if (truth) {
+			expression(*node.consequent, tail);
+			dropped += drop(*node.alternative);
+		}
+		else {
+			dropped += drop(*node.consequent);
+			expression(*node.alternative, tail);
+		}
+		return;
+	}
+
+	expression(*node.predicate);  // value will be popped in either branch
 	size_t jump_to_alternative = write_jump(opcode::JUMP_IF_FALSE);
 
 	write(opcode::POP);
-	expression();  // consequent
+	expression(*node.consequent, tail);
 	size_t jump_to_exit = write_jump(opcode::JUMP);
 
 	patch_jump(jump_to_alternative);
 	write(opcode::POP);
-	expression();  // alternative
+	expression(*node.alternative, tail);
 
 	patch_jump(jump_to_exit);
 }
@@ -489,95 +943,229 @@ Compiler::_if()
  * Compile a call to a built-in or user-defined function / combination.
  */
 void
-Compiler::call()
+Compiler::call(Call& node, bool tail)
 {
-	uint16_t number_arguments = 0;
-	while (scanner.current.type != token_type::RPAREN) {
+	if (tail && loop(node)) return;
+	if (primitive_call(node)) return;
+	if (node.callee->type == node_type::LAMBDA && vm.optimizer().level() >= 1 &&
+		node.arguments.size() == node.callee->cast<Lambda>()->parameters.size()) {
+		inline_call(node, tail);
+		return;
+	}
+
+	loop_types(node);
+	expression(*node.callee);
+	stack_depth++;
+	for (auto& argument : node.arguments) {
 		// TODO: consider role of thunk evaluation here.
-		if (scanner.current.type == token_type::END) {  // EOF reached early
-			error("Expected closing ')'", scanner.current);
-			break;
-		}
-		expression();
-		number_arguments++;
+		expression(*argument);
+		stack_depth++;
 	}
-	write(opcode::CALL);
-	write_uint16(number_arguments);
+	stack_depth -= node.arguments.size() + 1;
+	self_call(node);
+	line = node.token.line;
+	write_call(node.arguments.size(), node.token);
 }
 
-// TODO: refactor expression, parse_next, and definition_or_expression.
 /**
- * Parse and compile the next expression - may be self-evaluating or a
- * combination.
+ * Compile a call of a lambda written in place (e.g. a let) without creating
+ * a closure - its parameters become locals in a new scope, in the slots the
+ * arguments are pushed to. Afterwards END_SCOPE replaces the locals with the
+ * result, unless it is returned, which discards them anyway.
+ *
+ * @param node: AST for the call, with a lambda as the callee.
+ * @param tail: is the call's value returned from the function?
  */
 void
-Compiler::parse_next()
+Compiler::inline_call(Call& node, bool tail)
 {
-	advance();
-	switch (scanner.previous.type) {
-		case token_type::NUMBER:
-			number();
-			break;
-		case token_type::SYMBOL:
-			symbol();
-			break;
-		case token_type::FALSE:
-			write(opcode::FALSE);
-			break;
-		case token_type::TRUE:
-			write(opcode::TRUE);
-			break;
-		case token_type::NIL:
-			write(opcode::NIL);
-			break;
-		case token_type::LPAREN:
-			if (scanner.current.type == token_type::RPAREN) write(opcode::NIL);
-			else combination();
-			consume(token_type::RPAREN, "Expect ')'.");
-			break;
-		default:
-			error("unknown self-evaluating token type", scanner.previous);
+	auto callee = node.callee->cast<Lambda>();
+	size_t base = locals.size();
+	size_t slot = stack_depth;
+	std::vector<bool> typed;  // Is each argument a number?
+
+	for (auto& argument : node.arguments) {
+		expression(*argument);
+		stack_depth++;
+		typed.push_back(vm.optimizer().infer_types() && numeric(*argument));
+	}
+
+	scope_depth++;
+	for (size_t i = 0; i < callee->parameters.size(); i++) {
+		auto& parameter = callee->parameters[i];
+		add_local(Local{ .token = parameter,
+			.depth = static_cast<int>(scope_depth), .slot = slot + i,
+			.number = typed[i] && !assigned.contains(parameter.symbol) });
+	}
+	sequence(callee->body, tail);
+	scope_depth--;
+
+	size_t count = locals.size() - base;
+	remove_locals(base);
+	stack_depth = slot;
+
+	line = node.token.line;
+	if (!tail && count > 0) {
+		write_operand(opcode::END_SCOPE, count);
 	}
 }
 
 /**
- * Parse and compile a combination - special forms are handled using specific
- * tokens, and other built-ins and user-defined functions are handled
- * generally. '()' for 'NIL' is supported but is handled elsewhere.
+ * Write a call instruction with its own call site, which records the number
+ * of arguments. Calls with up to 3 arguments use an opcode implying the count.
+ * Call site indexes stay uint16, as the VM quickens calls in place.
+ *
+ * @param number_arguments: number of arguments on the stack above the callee.
+ * @param token: token to report an error at.
  */
 void
-Compiler::combination()
+Compiler::write_call(uint16_t number_arguments, const Token& token)
 {
-	advance();
-	switch (scanner.previous.type) {
-		case token_type::NOT:
-			_not();
-			break;
-		case token_type::AND:
-			_and();
-			break;
-		case token_type::OR:
-			_or();
-			break;
-		case token_type::DEFINE:
-			definition();
-			write(opcode::NIL);  // TODO: consider moving this to definition
-			break;
-		case token_type::SET:
-			set();
-			write(opcode::NIL);
-			break;
-		case token_type::LAMBDA:
-			lambda();
-			break;
-		case token_type::IF:
-			_if();
-			break;
-		case token_type::SYMBOL: // It's a (non special form) function call.
-			symbol();
-			call();
-			break;
+	size_t site = function->bytecode.add_call_site(number_arguments);
+	if (site > UINT16_MAX) error("Too many calls in one function", token);
+	write(number_arguments <= 3 ? opcode::CALL0 + number_arguments : opcode::CALL);
+	write_uint16(static_cast<uint16_t>(site));
+}
+
+/**
+ * Compile a two-argument call to a global operator that has its own opcode.
+ * The opcode checks at runtime that the global still holds the builtin. If
+ * both operands are known to be numbers, a typed opcode doesn't check them.
+ *
+ * @param node: AST for the call.
+ * @return: was the call compiled to the operator's opcode?
+ */
+bool
+Compiler::primitive_call(Call& node)
+{
+	if (node.callee->type != node_type::SYMBOL || node.arguments.size() != 2) return false;
+
+	int op = resolve_primitive(node.callee->token);
+	if (op < 0) return false;
+
+	expression(*node.arguments[0]);
+	stack_depth++;
+	expression(*node.arguments[1]);
+	stack_depth--;
+	line = node.token.line;
+	bool typed = vm.optimizer().infer_types() && numeric(*node.arguments[0]) &&
+		numeric(*node.arguments[1]);
+	write(typed ? number_opcode(op) : op);
+	return true;
+}
+
+/**
+ * Compile a tail call of the function being compiled, through the name it is
+ * bound to, as a loop - LOOP moves the arguments into the parameters' slots
+ * and jumps back to the start of the body, so no frame is pushed.
+ *
+ * @param node: AST for the call, which must be in tail position.
+ * @return: was the call compiled as a loop?
+ */
+bool
+Compiler::loop(Call& node)
+{
+	if (self.empty() || node.callee->type != node_type::SYMBOL) return false;
+	auto& name = node.callee->cast<Symbol>()->name;
+	if (name != self || node.arguments.size() != function->arity) return false;
+	if (resolve_local(node.callee->token.symbol) >= 0) return false;  // Shadowed in the body.
+
+	for (auto& argument : node.arguments) {
+		expression(*argument);
+		stack_depth++;
+	}
+	stack_depth -= node.arguments.size();
+	self_call(node);
+	line = node.token.line;
+	// Offset from the end of the instruction back to the start of the body.
+	size_t end = function->bytecode.instructions.size() + 3;
+	if (end > UINT16_MAX) {
+		write(opcode::WIDE);
+		write(opcode::LOOP);
+		write_uint32(static_cast<uint32_t>(end + 3));
+	}
+	else {
+		write(opcode::LOOP);
+		write_uint16(static_cast<uint16_t>(end));
+	}
+	return true;
+}
+
+/**
+ * Record which parameters of a loop's function (see loop_function) are bound
+ * to numbers by its first call, i.e. by the loop's initial values. Its other
+ * calls are in its own body - see self_call.
+ *
+ * @param node: AST for a call, which may start a loop.
+ */
+void
+Compiler::loop_types(Call& node)
+{
+	if (!vm.optimizer().infer_types()) return;
+	auto function = loop_function(node);
+	if (function == nullptr) return;
+
+	function->numbers.clear();
+	for (auto& argument : node.arguments) function->numbers.push_back(numeric(*argument));
+}
+
+/**
+ * Check the arguments of a call of the function being compiled through the
+ * name it is bound to. A parameter that was assumed to hold a number, but is
+ * passed something that may not be, no longer is - body() then compiles the
+ * body again.
+ *
+ * @param node: AST for the call, with its arguments already compiled.
+ */
+void
+Compiler::self_call(Call& node)
+{
+	if (self.empty() || node.callee->type != node_type::SYMBOL) return;
+	if (node.callee->cast<Symbol>()->name != self) return;
+	if (resolve_local(node.callee->token.symbol) >= 0) return;
+	if (node.arguments.size() != function->arity) return;
+
+	for (size_t i = 0; i < node.arguments.size(); i++) {
+		if (locals[i].number && !numeric(*node.arguments[i])) {
+			locals[i].number = false;
+			retype = true;
+		}
+	}
+}
+
+/**
+ * Is an expression known to always evaluate to a number? The result of + - *
+ * is if both operands are, as the builtins give nil for anything else. Once
+ * an operator has been rebound, typed opcodes check their operands again, so
+ * this doesn't need to consider it.
+ *
+ * @param node: AST for the expression, in the current scope.
+ * @return: does the expression always evaluate to a number?
+ */
+bool
+Compiler::numeric(Node& node)
+{
+	switch (node.type) {
+		case node_type::CONSTANT:
+			return node.cast<Constant>()->value.match_type(value_type::NUMBER);
+		case node_type::SYMBOL: {
+			int local = resolve_local(node.token.symbol);
+			if (local >= 0) return locals[local].number;
+			int upvalue = resolve_upvalue(node.token.symbol);
+			return upvalue >= 0 && upvalues[upvalue].number;
+			}
+		case node_type::IF: {
+			auto branch = node.cast<If>();
+			return numeric(*branch->consequent) && numeric(*branch->alternative);
+			}
+		case node_type::CALL: {
+			auto call = node.cast<Call>();
+			if (call->callee->type != node_type::SYMBOL || call->arguments.size() != 2) return false;
+			int op = resolve_primitive(call->callee->token);
+			if (op != opcode::ADD && op != opcode::SUBTRACT && op != opcode::MULTIPLY) return false;
+			return numeric(*call->arguments[0]) && numeric(*call->arguments[1]);
+			}
 		default:
-			error("expected symbol when reading combination", scanner.previous);
+			return false;
 	}
-}
\ No newline at end of file
+}
@@ -2,6 +2,7 @@
 #define LISP_COMPILER_H
 
 #include "common.h"
+#include "ast.h"
 #include "bytecode.h"
 #include "scanner.h"
 #include "value.h"
@@ -13,74 +14,111 @@
 struct Local {
 	Token token;
 	int depth;
+	size_t slot;  // Stack slot, not counting the function's closure.
 	bool captured = false;
+	bool initialized = true;  // False while the value of its definition is compiled.
+	int shadowed = -1;  // Index of the local with the same name it hides, or -1.
+	bool number = false;  // Always holds a number - see Compiler::numeric.
 };
 
 struct Upvalue {
-	size_t stack_index;  // Index in the runtime stack
+	size_t stack_index;  // Index in the runtime stack, or in the enclosing closure
 	bool is_local;
+	std::string name;
+	size_t symbol;
+	bool copied = false;  // Value copied into the closure rather than shared.
+	size_t index = 0;  // Index in the closure's upvalues or captures.
+	bool number = false;  // Always holds a number.
 };
 
 
 /**
- * Single-pass compiler that handles parsing and compilation - gets tokens
- * from the scanner and writes them as bytecode, resolving variables and
- * storing constants as needed.
- * 
+ * Generates bytecode from the AST built by the Parser, resolving variables
+ * and storing constants as needed. Each function gets its own Compiler.
+ *
  * NB: subject to change - some features of this class are likely best
  * encapsulated in other classes.
  */
 class Compiler {
 private:
-	Scanner& scanner; // TODO: move to parser?
 	VirtualMachine& vm;
-	
+
 	/* Function we're currently compiling. */
-	std::shared_ptr<Function> function = std::make_shared<Function>();
+	Function* function = vm.allocate<Function>();
 	/* Locals and upvalues for this scope. */
 	std::vector<Local> locals;
 	std::vector<Upvalue> upvalues;
+	// Innermost local and the upvalue with each name, by symbol (see intern).
+	std::unordered_map<size_t, int> local_indexes;
+	std::unordered_map<size_t, int> upvalue_indexes;
+	size_t captures = 0;  // Upvalues copied into the closure.
+	std::unordered_set<size_t> assigned;  // Symbols this function's code sets.
+	std::unordered_map<uint64_t, size_t> numbers;  // Constant index of each number, by bits.
 
 	Compiler* enclosing = nullptr;  // This needs to be nullable.
+	std::string self;  // Name bound to the function - see Lambda::self.
 	size_t scope_depth = 0;
+	size_t stack_depth = 0;  // Slot the next value pushed will be in.
+	size_t line = 0;  // Line of the node being compiled.
+	bool wide_jumps = false;  // Are forward jumps written with uint32 offsets?
+	bool jump_overflow = false;  // Did a forward jump not fit in a uint16?
+	bool retype = false;  // Was a parameter assumed to hold a number passed something else?
+	size_t dropped = 0;  // Bytes of unused code left out - see drop.
 
 	bool had_error = false;  // TODO: clean this up
 	bool panic_mode = false;
-	void advance();
-	void consume(token_type expected, std::string error_message);
 
-	void parse_next();  // TODO: infix . for cons - excuse to practice parser design
-	void definition_or_expression();  // TODO: synchronize here
-	void expression();
+	void expression(Node& node, bool tail = false);
+	void sequence(Program& expressions, bool tail);
+	void body(Program& expressions);
+	void finish(std::string name);
+	size_t drop(Node& node);
 
-	void number();
 	void constant(Value value);
-	void definition();
-	void set();
-	void lambda();
-	void _if();
+	size_t make_constant(Value value);
+	void definition(Assignment& node);
+	void set(Assignment& node);
+	void lambda(Lambda& node);
+	void function_body(Lambda& node);
+	void defer_body(Lambda& node);
+	void _if(If& node, bool tail);
 	void error(std::string error_message, Token token);
-	void combination();
-	void _not();
-	void _and();
-	void _or();
-	void symbol();
-	void call();
+	void _not(Logical& node);
+	void _and(Logical& node);
+	void _or(Logical& node);
+	void symbol(Symbol& node);
+	void call(Call& node, bool tail);
+	bool primitive_call(Call& node);
+	bool loop(Call& node);
+	void inline_call(Call& node, bool tail);
+	void loop_types(Call& node);
+	void self_call(Call& node);
+	bool numeric(Node& node);
 
 	void write(uint8_t op);
 	void write_uint16(uint16_t uint);
+	void write_uint32(uint32_t uint);
+	void write_operand(uint8_t op, size_t operand);
+	void write_call(uint16_t number_arguments, const Token& token);
 	size_t write_jump(uint8_t jump);
 	void patch_jump(size_t patch_index);
 
-	int resolve_local(Token token);
-	int resolve_upvalue(Token token);
-	int push_upvalue(int index, bool local);
+	void add_local(Local local);
+	void remove_locals(size_t base);
+	int resolve_local(size_t symbol);
+	int resolve_upvalue(size_t symbol);
+	int push_upvalue(int index, bool local, const std::string& name, size_t symbol, bool copied);
+	int resolve_primitive(const Token& name);
+	Compiler(VirtualMachine& vm, Function* function) : vm{ vm }, function{ function },
+		scope_depth{ 1 } {};
 public:
-	Compiler(Scanner& scanner, VirtualMachine& vm) : scanner{ scanner }, vm{ vm } {};
-	Compiler(Compiler* enclosing) : enclosing{ enclosing }, scanner{ enclosing->scanner },
-		vm{ enclosing->vm }, scope_depth{enclosing->scope_depth + 1} {};
+	Compiler(VirtualMachine& vm) : vm{ vm } {};
+	Compiler(Compiler* enclosing) : enclosing{ enclosing }, vm{ enclosing->vm },
+		scope_depth{ enclosing->scope_depth + 1 } {};
 	bool error() { return had_error; };  // TODO: needed?
-	std::shared_ptr<Function> compile();
+	Function* compile(Program& program);
+	static bool recompile(VirtualMachine& vm, Function* function, Lambda& node,
+		const std::vector<std::string>& captured, const std::vector<bool>& copied);
 };
 
-#endif
\ No newline at end of file
+#endif
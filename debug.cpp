@@ -32,30 +32,21 @@ simpleInstruction(std::string name, size_t offset)
 	return offset + 1;
 }
 
-// DEPRACATED>
 /**
- * Print a constant (including its value) in human-readable format.
+ * Print the name of an instruction that loads a constant, and the constant.
  *
  * @param name: human-readable name of instruction.
- * @param bytecode: bytecode where constant is stored.
- * @param offset: location of instruction in bytecode.
- * @return: location of next bytecode instruction.
+ * @param value: constant loaded.
  */
-static size_t
-longConstantInstruction(std::string name, Chunk& bytecode, size_t offset)
+static void
+printConstant(std::string name, Value value)
 {
-	// NB: Endianness is important here
-	uint8_t constant = bytecode.instructions[offset + 1];
-	uint8_t overflow = bytecode.instructions[offset + 2];
-	uint16_t index = static_cast<uint16_t>(overflow) * 256 + constant;
-	
-	Value value = bytecode.constants[index];
-	switch (value.type) {
+	switch (value.type()) {
 	case value_type::NUMBER:
-		std::cerr << name << ' ' << value.as.number << '\n';
+		std::cerr << name << ' ' << value.as_number() << '\n';
 		break;
 	case value_type::BOOL:
-		std::cerr << name << ' ' << value.as.boolean << '\n';
+		std::cerr << name << ' ' << value.as_boolean() << '\n';
 		break;
 	case value_type::NIL:
 		std::cerr << name << ' ' << "nil" << '\n';
@@ -66,10 +57,75 @@ longConstantInstruction(std::string name, Chunk& bytecode, size_t offset)
 	default:
 		std::cerr << name << " unknown type" << '\n';
 	}
+}
 
+// DEPRACATED>
+/**
+ * Print a constant (including its value) in human-readable format.
+ *
+ * @param name: human-readable name of instruction.
+ * @param bytecode: bytecode where constant is stored.
+ * @param offset: location of instruction in bytecode.
+ * @return: location of next bytecode instruction.
+ */
+static size_t
+longConstantInstruction(std::string name, Chunk& bytecode, size_t offset)
+{
+	// NB: Endianness is important here
+	uint8_t constant = bytecode.instructions[offset + 1];
+	uint8_t overflow = bytecode.instructions[offset + 2];
+	uint16_t index = static_cast<uint16_t>(overflow) * 256 + constant;
+	
+	printConstant(name, bytecode.constants[index]);
 	return offset + 3;
 }
 
+/**
+ * Print a constant with an 8-bit index in human-readable format.
+ *
+ * @param name: human-readable name of instruction.
+ * @param bytecode: bytecode where constant is stored.
+ * @param offset: location of instruction in bytecode.
+ * @return: location of next bytecode instruction.
+ */
+static size_t
+shortConstantInstruction(std::string name, Chunk& bytecode, size_t offset)
+{
+	printConstant(name, bytecode.constants[bytecode.instructions[offset + 1]]);
+	return offset + 2;
+}
+
+/**
+ * Print an instruction with a uint8 component in human-readable format.
+ *
+ * @param name: human-readable name of instruction.
+ * @param bytecode: bytecode where instruction is stored.
+ * @param offset: location of instruction in bytecode.
+ * @return: location of next bytecode instruction.
+ */
+static size_t
+byteInstruction(std::string name, Chunk& bytecode, size_t offset)
+{
+	std::cerr << name << ' ' << static_cast<int>(bytecode.instructions[offset + 1]) << '\n';
+	return offset + 2;
+}
+
+/**
+ * Print an instruction with a signed 8-bit immediate in human-readable format.
+ *
+ * @param name: human-readable name of instruction.
+ * @param bytecode: bytecode where instruction is stored.
+ * @param offset: location of instruction in bytecode.
+ * @return: location of next bytecode instruction.
+ */
+static size_t
+smallIntInstruction(std::string name, Chunk& bytecode, size_t offset)
+{
+	auto immediate = static_cast<int8_t>(bytecode.instructions[offset + 1]);
+	std::cerr << name << ' ' << static_cast<int>(immediate) << '\n';
+	return offset + 2;
+}
+
 /**
  * Print an instruction with a uint16 component in human-readable format.
  *
@@ -91,36 +147,96 @@ uintInstruction(std::string name, Chunk& bytecode, size_t offset)
 	return offset + 3;
 }
 
+/**
+ * Print an instruction with two uint16 components, e.g. a superinstruction.
+ *
+ * @param name: human-readable name of instruction.
+ * @param bytecode: bytecode where instruction is stored.
+ * @param offset: location of instruction in bytecode.
+ * @return: location of next bytecode instruction.
+ */
+static size_t
+doubleUintInstruction(std::string name, Chunk& bytecode, size_t offset)
+{
+	uint16_t first = static_cast<uint16_t>(bytecode.instructions[offset + 2]) * 256 +
+		bytecode.instructions[offset + 1];
+	uint16_t second = static_cast<uint16_t>(bytecode.instructions[offset + 4]) * 256 +
+		bytecode.instructions[offset + 3];
+
+	std::cerr << name << ' ' << first << ' ' << second << '\n';
+
+	return offset + 5;
+}
+
+/**
+ * Print a call instruction - number of arguments and call site index.
+ *
+ * @param name: human-readable name of instruction.
+ * @param bytecode: bytecode where instruction is located.
+ * @param offset: location of instruction in bytecode.
+ * @return: location of next bytecode instruction.
+ */
+static size_t
+callInstruction(std::string name, Chunk& bytecode, size_t offset)
+{
+	uint16_t site = static_cast<uint16_t>(bytecode.instructions[offset + 2]) * 256 +
+		bytecode.instructions[offset + 1];
+
+	std::cerr << name << ' ' << bytecode.call_sites[site].arguments
+		<< " (site " << site << ")\n";
+
+	return offset + 3;
+}
 
 static size_t
 closure(std::string name, Chunk& bytecode, size_t offset)
 {
-	// NB: Endianness is important here
-	uint8_t uint8 = bytecode.instructions[offset + 1];
-	uint8_t overflow = bytecode.instructions[offset + 2];
-	uint16_t uint16 = static_cast<uint16_t>(overflow) * 256 + uint8;
+	// A WIDE prefix makes every index a uint32 rather than a uint16.
+	bool wide = bytecode.instructions[offset] == opcode::WIDE;
+	size_t index_size = wide ? 4 : 2;
+	size_t constant = bytecode.operand(offset);
 
-	std::cerr << name << ' ' << uint16 << '\n';
-	offset += 3;
+	std::cerr << name << ' ' << constant << '\n';
+	offset += (wide ? 2 : 1) + index_size;
 
-	Value data = bytecode.constants[uint16];
+	Value data = bytecode.constants[constant];
 	if (!data.match_data_type(data_type::FUNCTION)) {
 		std::cerr << "ERROR READING FUNCTION VARIABLES" << '\n';
 		return offset;
 	}
 
-	std::shared_ptr<Function> func = std::any_cast<std::shared_ptr<Function>>(data.as.data->data);
-	for (size_t i = 0; i < func->upvalues; i++) {
-		int local = bytecode.instructions[offset++];
-		uint8_t index_uint8 = bytecode.instructions[offset++];
-		uint8_t index_overflow = bytecode.instructions[offset++];
-		uint16_t index = static_cast<uint16_t>(index_overflow) * 256 + index_uint8;
-		std::cerr << "   | " << (local ? "local " : "upvalue ") << index << '\n';
+	Function* func = data.as_data()->cast<Function>();
+	for (size_t i = 0; i < func->upvalues + func->captures; i++) {
+		uint8_t flags = bytecode.instructions[offset++];
+		size_t index = 0;  // Little-endian.
+		for (size_t byte = index_size; byte > 0; byte--) {
+			index = index * 256 + bytecode.instructions[offset + byte - 1];
+		}
+		offset += index_size;
+		std::cerr << "   | " << (flags & capture::LOCAL ? "local " : "upvalue ") << index;
+		std::cerr << (flags & capture::COPY ? " (copy)" : "") << '\n';
 	}
 
 	return offset;
 }
 
+/**
+ * Print an instruction with a WIDE prefix, which makes its operands uint32.
+ *
+ * @param bytecode: bytecode where instruction is located.
+ * @param offset: location of the prefix in bytecode.
+ * @return: location of next bytecode instruction.
+ */
+static size_t
+wideInstruction(Chunk& bytecode, size_t offset)
+{
+	uint8_t op = bytecode.instructions[offset + 1];
+	if (op == opcode::CLOSURE) return closure("WIDE CLOSURE", bytecode, offset);
+
+	std::cerr << "WIDE " << opcodeName(op) << ' ' << bytecode.operand(offset) << '\n';
+	return offset + 6;
+}
+
 /**
  * Print an instruction in human-readable format.
  *
@@ -150,8 +266,28 @@ disassembleInstruction(Chunk& bytecode, size_t offset, size_t& line)
 		return longConstantInstruction("CONSTANT", bytecode, offset);
 	case opcode::ADD:
 		return simpleInstruction("ADD", offset);
+	case opcode::SUBTRACT:
+		return simpleInstruction("SUBTRACT", offset);
+	case opcode::MULTIPLY:
+		return simpleInstruction("MULTIPLY", offset);
 	case opcode::EQUAL:
 		return simpleInstruction("EQUAL", offset);
+	case opcode::LESS:
+		return simpleInstruction("LESS", offset);
+	case opcode::GREATER:
+		return simpleInstruction("GREATER", offset);
+	case opcode::ADD_NUMBERS:
+		return simpleInstruction("ADD NUMBERS", offset);
+	case opcode::SUBTRACT_NUMBERS:
+		return simpleInstruction("SUBTRACT NUMBERS", offset);
+	case opcode::MULTIPLY_NUMBERS:
+		return simpleInstruction("MULTIPLY NUMBERS", offset);
+	case opcode::EQUAL_NUMBERS:
+		return simpleInstruction("EQUAL NUMBERS", offset);
+	case opcode::LESS_NUMBERS:
+		return simpleInstruction("LESS NUMBERS", offset);
+	case opcode::GREATER_NUMBERS:
+		return simpleInstruction("GREATER NUMBERS", offset);
 	case opcode::CONS:
 		return simpleInstruction("CONS", offset);
 	case opcode::TRUE:
@@ -174,6 +310,8 @@ disassembleInstruction(Chunk& bytecode, size_t offset, size_t& line)
 		return uintInstruction("GET UPVALUE", bytecode, offset);
 	case opcode::SET_UPVALUE:
 		return uintInstruction("SET UPVALUE", bytecode, offset);
+	case opcode::GET_CAPTURED:
+		return uintInstruction("GET CAPTURED", bytecode, offset);
 	case opcode::GET_LOCAL:
 		return uintInstruction("GET LOCAL", bytecode, offset);
 	case opcode::SET_LOCAL:
@@ -182,15 +320,145 @@ disassembleInstruction(Chunk& bytecode, size_t offset, size_t& line)
 		return uintInstruction("JUMP", bytecode, offset);
 	case opcode::JUMP_IF_FALSE:
 		return uintInstruction("JUMP IF FALSE", bytecode, offset);
+	case opcode::JUMP_IF_TRUE:
+		return uintInstruction("JUMP IF TRUE", bytecode, offset);
+	case opcode::LOOP:
+		return uintInstruction("LOOP", bytecode, offset);
 	case opcode::CALL:
-		return uintInstruction("CALL", bytecode, offset);
+		return callInstruction("CALL", bytecode, offset);
 	case opcode::TAIL_CALL:
-		return uintInstruction("TAIL CALL", bytecode, offset);
+		return callInstruction("TAIL CALL", bytecode, offset);
+	case opcode::CALL0:
+		return callInstruction("CALL0", bytecode, offset);
+	case opcode::CALL1:
+		return callInstruction("CALL1", bytecode, offset);
+	case opcode::CALL2:
+		return callInstruction("CALL2", bytecode, offset);
+	case opcode::CALL3:
+		return callInstruction("CALL3", bytecode, offset);
+	case opcode::CALL_CLOSURE:
+		return callInstruction("CALL CLOSURE", bytecode, offset);
+	case opcode::CALL_BUILTIN:
+		return callInstruction("CALL BUILTIN", bytecode, offset);
+	case opcode::CALL_SAME_FUNCTION:
+		return callInstruction("CALL SAME FUNCTION", bytecode, offset);
 	case opcode::CLOSURE:
 		return closure("CLOSURE", bytecode, offset);
+	case opcode::END_SCOPE:
+		return uintInstruction("END SCOPE", bytecode, offset);
+	case opcode::GET_LOCAL_CONSTANT:
+		return doubleUintInstruction("GET LOCAL CONSTANT", bytecode, offset);
+	case opcode::GET_LOCAL_LOCAL:
+		return doubleUintInstruction("GET LOCAL LOCAL", bytecode, offset);
+	case opcode::GET_GLOBAL_LOCAL:
+		return doubleUintInstruction("GET GLOBAL LOCAL", bytecode, offset);
+	case opcode::POP_GET_LOCAL:
+		return uintInstruction("POP GET LOCAL", bytecode, offset);
+	case opcode::POP_GET_GLOBAL:
+		return uintInstruction("POP GET GLOBAL", bytecode, offset);
+	case opcode::JUMP_IF_FALSE_POP:
+		return uintInstruction("JUMP IF FALSE POP", bytecode, offset);
+	case opcode::GET_LOCAL_0:
+		return simpleInstruction("GET LOCAL 0", offset);
+	case opcode::GET_LOCAL_1:
+		return simpleInstruction("GET LOCAL 1", offset);
+	case opcode::GET_LOCAL_2:
+		return simpleInstruction("GET LOCAL 2", offset);
+	case opcode::GET_LOCAL_3:
+		return simpleInstruction("GET LOCAL 3", offset);
+	case opcode::GET_LOCAL_SHORT:
+		return byteInstruction("GET LOCAL SHORT", bytecode, offset);
+	case opcode::GET_GLOBAL_SHORT:
+		return byteInstruction("GET GLOBAL SHORT", bytecode, offset);
+	case opcode::CONSTANT_SHORT:
+		return shortConstantInstruction("CONSTANT SHORT", bytecode, offset);
+	case opcode::SMALL_INT:
+		return smallIntInstruction("SMALL INT", bytecode, offset);
+	case opcode::WIDE:
+		return wideInstruction(bytecode, offset);
 	default:
 		int undefined_opcode = static_cast<int>(instruction);
 		std::cerr << "Unknown opcode " << undefined_opcode << "\n";
 		return offset + 1;
 	}
 }
+
+
+/**
+ * Print the feedback recorded for each call site in a chunk of bytecode.
+ * 
+ * @param bytecode: bytecode whose call sites to print.
+ * @param name: name of function (if applicable).
+ */
+void
+disassembleCallSites(Chunk& bytecode, std::string name)
+{
+	static const char* states[] = { "uninitialized", "monomorphic", "polymorphic", "megamorphic" };
+	static const char* types[] = { "bool", "nil", "number", "data", "uninitialized", "undefined" };
+
+	std::cerr << "== " << name << " call sites ==\n";
+	for (size_t i = 0; i < bytecode.call_sites.size(); i++) {
+		CallSite& site = bytecode.call_sites[i];
+		std::cerr << std::setfill('0') << std::setw(4) << i << ' '
+			<< states[static_cast<int>(site.state())] << '\n';
+
+		for (size_t j = 0; j < site.size; j++) {
+			CallSite::Entry& entry = site.entries[j];
+			if (!entry.closure) {
+				std::cerr << "   | " << entry.target->cast<BuiltinFunction>()->name();
+			}
+			else {
+				Function* function = entry.target->cast<Function>();
+				std::cerr << "   | " << (function->anonymous() ? "lambda" : function->name);
+			}
+			std::cerr << " x" << entry.count;
+
+			for (size_t k = 0; k < CallSite::TYPED_ARGUMENTS; k++) {
+				if (entry.argument_types[k] == 0) break;
+				std::cerr << (k == 0 ? " (" : ", ");
+				const char* separator = "";
+				for (size_t type = 0; type < sizeof(types) / sizeof(types[0]); type++) {
+					if (entry.argument_types[k] & (1 << type)) {
+						std::cerr << separator << types[type];
+						separator = "|";
+					}
+				}
+			}
+			std::cerr << (entry.argument_types[0] ? ")\n" : "\n");
+		}
+	}
+}
+
+/**
+ * Human-readable name of an opcode, as used in disassembly.
+ * 
+ * @param op: opcode.
+ * @return: name of the opcode.
+ */
+const char*
+opcodeName(uint8_t op)
+{
+	static const char* names[] = {
+		"CONSTANT", "TRUE", "FALSE", "NIL",
+		"ADD", "SUBTRACT", "MULTIPLY", "NOT",
+		"EQUAL", "LESS", "GREATER", "CONS",
+		"DEFINE GLOBAL", "GET GLOBAL", "SET GLOBAL",
+		"GET LOCAL", "SET LOCAL",
+		"GET UPVALUE", "SET UPVALUE", "GET CAPTURED",
+		"RETURN", "POP",
+		"JUMP", "JUMP IF FALSE", "JUMP IF TRUE", "LOOP",
+		"CALL", "TAIL CALL", "CLOSURE", "END SCOPE",
+		"CALL0", "CALL1", "CALL2", "CALL3",
+		"CALL CLOSURE", "CALL BUILTIN", "CALL SAME FUNCTION",
+		"GET LOCAL CONSTANT", "GET LOCAL LOCAL", "GET GLOBAL LOCAL",
+		"POP GET LOCAL", "POP GET GLOBAL", "JUMP IF FALSE POP",
+		"GET LOCAL 0", "GET LOCAL 1", "GET LOCAL 2", "GET LOCAL 3",
+		"GET LOCAL SHORT", "GET GLOBAL SHORT", "CONSTANT SHORT", "SMALL INT",
+		"ADD NUMBERS", "SUBTRACT NUMBERS", "MULTIPLY NUMBERS",
+		"EQUAL NUMBERS", "LESS NUMBERS", "GREATER NUMBERS",
+		"WIDE"
+	};
+	static_assert(sizeof(names) / sizeof(names[0]) == opcode::OPCODE_COUNT);
+
+	return op < opcode::OPCODE_COUNT ? names[op] : "UNKNOWN";
+}
@@ -5,5 +5,7 @@
 
 void disassembleBytecode(Chunk& bytecode, std::string name);
 size_t disassembleInstruction(Chunk& bytecode, size_t offset, size_t& line);
+void disassembleCallSites(Chunk& bytecode, std::string name);
+const char* opcodeName(uint8_t op);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,719 @@
+#include "fold.h"
+#include "compiler.h"
+#include "function.h"
+#include "vm.h"
+
+/**
+ * Truth value of a constant, following the VM - everything but false is true.
+ *
+ * @param value: constant to test.
+ * @return: is the constant not 'false'?
+ */
+static bool
+truthy(Value value)
+{
+	return value.match_type(value_type::BOOL) ? value.as_boolean() : true;
+}
+
+/**
+ * Does anything in a subtree assign to a name? Shadowing is ignored, so this
+ * errs on the side of yes.
+ *
+ * @param node: subtree to search, including nested lambdas.
+ * @param name: name to search for.
+ * @return: is there a set of the name?
+ */
+static bool
+assigns(Node& node, const std::string& name)
+{
+	if (node.type == node_type::SET && node.cast<Assignment>()->name == name) return true;
+	if (node.type == node_type::LAMBDA) {
+		for (auto& assigned : node.cast<Lambda>()->assigned) {
+			if (assigned.string == name) return true;
+		}
+	}
+	for (auto child : children(node)) {
+		if (assigns(**child, name)) return true;
+	}
+	return false;
+}
+
+/**
+ * Does a subtree refer to a name, other than in one node? Like assigns, this
+ * ignores shadowing, and includes the unparsed body of each lazy lambda and the
+ * unoptimized AST of each lambda.
+ *
+ * @param node: subtree to search, including nested lambdas.
+ * @param name: name to search for.
+ * @param skip: node not to search.
+ * @return: is the name referred to, set, or defined?
+ */
+static bool
+refers(Node& node, const std::string& name, Node* skip)
+{
+	if (&node == skip) return false;
+	if (node.type == node_type::SYMBOL && node.cast<Symbol>()->name == name) return true;
+	if ((node.type == node_type::SET || node.type == node_type::DEFINE) &&
+		node.cast<Assignment>()->name == name) {
+		return true;
+	}
+	if (node.type == node_type::LAMBDA) {
+		auto& lambda = *node.cast<Lambda>();
+		for (auto& reference : lambda.references) {
+			if (reference.string == name) return true;
+		}
+		if (lambda.original && refers(*lambda.original, name, skip)) return true;
+	}
+	for (auto child : children(node)) {
+		if (refers(**child, name, skip)) return true;
+	}
+	return false;
+}
+
+/**
+ * Keep the definitions of locals in a lambda's scope that turn out to be
+ * referred to - they were marked unused when their value was folded. Nested
+ * lambdas have scopes of their own.
+ *
+ * @param node: subtree of the lambda's body to search.
+ * @param scope: lambda whose locals are defined.
+ */
+static void
+keep_referenced(Node& node, Lambda& scope)
+{
+	if (node.type == node_type::DEFINE && node.unused) {
+		auto& name = node.cast<Assignment>()->name;
+		node.unused = std::ranges::none_of(scope.body, [&](auto& expression) {
+			return refers(*expression, name, &node);
+		});
+	}
+	for (auto child : children(node)) {
+		if ((*child)->type != node_type::LAMBDA) keep_referenced(**child, scope);
+	}
+}
+
+/**
+ * Fold the expressions of a REPL line. Anything relying on a global that this
+ * line assigns to is invalidated first, and nothing in the line relies on it.
+ *
+ * @param program: AST of the REPL line, rewritten in place.
+ */
+void
+ConstantFolder::run(Program& program)
+{
+	// A definition only counts once it has run - the previous line may have
+	// failed before reaching it. Nothing that relied on it can have run either.
+	for (auto& name : unconfirmed) {
+		if (vm.check_global(name)) continue;
+		if (constants.erase(name) + functions.erase(name) == 0) continue;
+		std::erase_if(dependents, [&](Dependent& dependent) {
+			return std::ranges::count(dependent.assumptions, name) > 0;
+		});
+	}
+	unconfirmed.clear();
+
+	std::unordered_map<std::string, int> defines;
+	std::vector<std::string> assigned;
+	for (auto& node : program) scan(*node, defines, assigned);
+	for (auto& name : assigned) invalidate(name);
+
+	for (auto& node : program) {
+		// Only a top-level definition is certain to run before what follows.
+		Assignment* definition = nullptr;
+		if (node->type == node_type::DEFINE) {
+			definition = node->cast<Assignment>();
+			if (defines[definition->name] != 1 || mutated.contains(definition->name) ||
+				vm.check_global(definition->name)) {  // Redefinition is an error.
+				definition = nullptr;
+			}
+		}
+
+		// A function bound to a global that is never reassigned can loop by
+		// calling itself - relying on the global, like a constant.
+		std::unique_ptr<Node> unfolded;
+		if (definition && definition->value->type == node_type::LAMBDA) {
+			auto function = definition->value->cast<Lambda>();
+			function->self = definition->name;
+			function->assumptions.push_back(definition->name);
+			if (vm.optimizer().level() >= 2) unfolded = clone(*function);
+		}
+
+		fold(node);
+		if (node != program.back()) node->unused = discardable(*node);
+
+		if (!definition) continue;
+		unconfirmed.push_back(definition->name);
+		if (definition->value->type == node_type::CONSTANT) {
+			constants.insert_or_assign(definition->name, definition->value->cast<Constant>()->value);
+		}
+		if (unfolded) remember(definition->name, std::move(unfolded));
+	}
+}
+
+/**
+ * Fold the body of a lazy lambda, parsed when the function is first called.
+ * Its upvalues are bound, as the enclosing lambdas were when its line was
+ * folded. Anything it relies on is recorded once it is compiled.
+ *
+ * @param node: lazy lambda with its body, rewritten in place.
+ * @param captured: names of the function's upvalues.
+ */
+void
+ConstantFolder::fold_lazy(Lambda& node, const std::vector<std::string>& captured)
+{
+	// The global the function is bound to may have been assigned since.
+	if (std::ranges::count(node.assumptions, node.self) > 0 && mutated.contains(node.self)) {
+		std::erase(node.assumptions, node.self);
+		node.self.clear();
+	}
+
+	scopes.push_back(captured);
+	fold_lambda(node);
+	scopes.pop_back();
+}
+
+/**
+ * Record the globals that a subtree defines and assigns to.
+ *
+ * @param node: subtree to scan.
+ * @param defines: number of definitions of each global so far.
+ * @param assigned: globals assigned to for the first time.
+ */
+void
+ConstantFolder::scan(Node& node, std::unordered_map<std::string, int>& defines,
+	std::vector<std::string>& assigned)
+{
+	switch (node.type) {
+		case node_type::DEFINE: {
+			auto& name = node.cast<Assignment>()->name;
+			if (scopes.empty()) defines[name]++;
+			else scopes.back().push_back(name);
+			}
+			break;
+		case node_type::SET: {
+			auto& name = node.cast<Assignment>()->name;
+			if (!bound(name) && mutated.insert(name).second) assigned.push_back(name);
+			}
+			break;
+		case node_type::LAMBDA:
+			scopes.emplace_back();
+			for (auto& parameter : node.cast<Lambda>()->parameters) {
+				scopes.back().push_back(parameter.string);
+			}
+			for (auto& expression : node.cast<Lambda>()->body) scan(*expression, defines, assigned);
+			for (auto& name : node.cast<Lambda>()->assigned) {
+				if (!bound(name.string) && mutated.insert(name.string).second) assigned.push_back(name.string);
+			}
+			scopes.pop_back();
+			return;
+		default:
+			break;
+	}
+
+	for (auto child : children(node)) scan(**child, defines, assigned);
+}
+
+/**
+ * Fold a subtree, replacing it if its value is known.
+ *
+ * @param node: slot holding the subtree.
+ */
+void
+ConstantFolder::fold(std::unique_ptr<Node>& node)
+{
+	switch (node->type) {
+		case node_type::CONSTANT:
+			break;
+		case node_type::SYMBOL: {
+			auto& name = node->cast<Symbol>()->name;
+			if (bound(name) || !constants.contains(name)) break;
+			assume(name);
+			replace(node, constants.at(name));
+			}
+			break;
+		case node_type::DEFINE: {
+			auto definition = node->cast<Assignment>();
+			if (!scopes.empty()) {
+				scopes.back().push_back(definition->name);
+				// A local that is never reassigned always holds its function.
+				if (definition->value->type == node_type::LAMBDA && !lambdas.empty() &&
+					!assigns(*lambdas.back().lambda, definition->name)) {
+					definition->value->cast<Lambda>()->self = definition->name;
+				}
+			}
+			fold(definition->value);
+			// Until found to be referred to - see keep_referenced.
+			if (!scopes.empty() && !lambdas.empty()) node->unused = discardable(*definition->value);
+			}
+			break;
+		case node_type::SET:
+			fold(node->cast<Assignment>()->value);
+			break;
+		case node_type::LAMBDA:
+			if (!node->cast<Lambda>()->lazy()) fold_lambda(*node->cast<Lambda>());
+			break;
+		case node_type::IF:
+			fold_if(node);
+			break;
+		case node_type::AND:
+		case node_type::OR:
+		case node_type::NOT:
+			fold_logical(node);
+			break;
+		case node_type::CALL:
+			fold_call(node);
+			break;
+		case node_type::BEGIN:
+			mark_unused(node->cast<Sequence>()->body);
+			break;
+	}
+}
+
+/**
+ * Fold a function body. A copy of the lambda is kept in case the function
+ * has to be recompiled - it is dropped again if nothing was assumed. A lambda
+ * that is inlined is part of the enclosing function instead.
+ *
+ * @param node: lambda to fold.
+ * @param inlined: is the lambda inlined where it is called?
+ */
+void
+ConstantFolder::fold_lambda(Lambda& node, bool inlined)
+{
+	if (!inlined) node.original.reset(static_cast<Lambda*>(clone(node).release()));
+
+	// A local the function is bound to is in scope even if it is not captured
+	// (calls through it may become loops), so keep it bound when recompiling.
+	bool local_self = !node.self.empty() && std::ranges::count(node.assumptions, node.self) == 0;
+	if (local_self) scopes.push_back({ node.self });
+
+	scopes.emplace_back();
+	for (auto& parameter : node.parameters) scopes.back().push_back(parameter.string);
+	lambdas.push_back(Enclosing{ .lambda = &node, .inlined = inlined });
+
+	mark_unused(node.body);
+	for (auto& expression : node.body) keep_referenced(*expression, node);
+
+	lambdas.pop_back();
+	scopes.pop_back();
+	if (local_self) scopes.pop_back();
+
+	if (node.assumptions.empty()) node.original.reset();
+}
+
+/**
+ * Replace an if with one of its branches if the predicate is constant.
+ *
+ * @param node: slot holding the if.
+ */
+void
+ConstantFolder::fold_if(std::unique_ptr<Node>& node)
+{
+	auto branch = node->cast<If>();
+	fold(branch->predicate);
+	fold(branch->consequent);
+	fold(branch->alternative);
+
+	if (branch->predicate->type != node_type::CONSTANT) return;
+	bool truth = truthy(branch->predicate->cast<Constant>()->value);
+	if (!droppable(truth ? *branch->alternative : *branch->consequent)) return;
+
+	auto taken = std::move(truth ? branch->consequent : branch->alternative);
+	node = std::move(taken);
+}
+
+/**
+ * Fold a logical operator with a constant (left) operand. AND and OR produce
+ * a boolean, so a non-constant right operand that decides the result becomes
+ * a double NOT.
+ *
+ * @param node: slot holding the operator.
+ */
+void
+ConstantFolder::fold_logical(std::unique_ptr<Node>& node)
+{
+	auto logical = node->cast<Logical>();
+	fold(logical->left);
+	if (logical->right) fold(logical->right);
+
+	if (logical->left->type != node_type::CONSTANT) return;
+	bool left = truthy(logical->left->cast<Constant>()->value);
+
+	if (node->type == node_type::NOT) {
+		replace(node, Value(!left));
+		return;
+	}
+
+	// AND is decided by a false left operand, OR by a true one.
+	bool decided = node->type == node_type::AND ? !left : left;
+	if (decided) {
+		if (droppable(*logical->right)) replace(node, Value(left));
+		return;
+	}
+
+	if (logical->right->type == node_type::CONSTANT) {
+		replace(node, Value(truthy(logical->right->cast<Constant>()->value)));
+		return;
+	}
+	auto inner = std::make_unique<Logical>(node_type::NOT, node->token);
+	inner->left = std::move(logical->right);
+	auto outer = std::make_unique<Logical>(node_type::NOT, node->token);
+	outer->left = std::move(inner);
+	node = std::move(outer);
+}
+
+/**
+ * Evaluate a call to an operator whose arguments are constant. A callee symbol
+ * is left alone so that calls which are not folded still compile to the
+ * operator's opcode. A lambda called with the right number of arguments is
+ * inlined by the Compiler, and is folded as part of the enclosing function.
+ *
+ * @param node: slot holding the call.
+ */
+void
+ConstantFolder::fold_call(std::unique_ptr<Node>& node)
+{
+	auto call = node->cast<Call>();
+	for (auto& argument : call->arguments) fold(argument);
+
+	bool inlined = call->callee->type == node_type::SYMBOL && inline_global(*call);
+	if (call->callee->type == node_type::LAMBDA &&
+		call->callee->cast<Lambda>()->parameters.size() == call->arguments.size()) {
+		fold_lambda(*call->callee->cast<Lambda>(), true);
+	}
+	else if (call->callee->type != node_type::SYMBOL) {
+		fold(call->callee);
+	}
+	if (inlined) inlining.pop_back();
+
+	if (call->callee->type != node_type::SYMBOL || call->arguments.size() != 2) return;
+	for (auto& argument : call->arguments) {
+		if (argument->type != node_type::CONSTANT) return;
+	}
+
+	auto& name = call->callee->cast<Symbol>()->name;
+	if (bound(name) || mutated.contains(name)) return;
+	BuiltinFunction* builtin = vm.pure_builtin(name);
+	if (builtin == nullptr) return;
+
+	Value arguments[] = {
+		call->arguments[0]->cast<Constant>()->value,
+		call->arguments[1]->cast<Constant>()->value
+	};
+	assume(name);
+	replace(node, builtin->call(arguments, 2));
+}
+
+/**
+ * Replace the callee of a call to a small global function with a copy of the
+ * function, to be inlined. The caller then relies on the global being
+ * unchanged. A function is not inlined into its own copies, which stops
+ * functions calling each other from being inlined forever.
+ *
+ * @param call: call with a symbol as the callee.
+ * @return: was the callee replaced? If so, it is on the inlining stack.
+ */
+bool
+ConstantFolder::inline_global(Call& call)
+{
+	auto& name = call.callee->cast<Symbol>()->name;
+	auto entry = functions.find(name);
+	if (entry == functions.end() || bound(name) || std::ranges::count(inlining, name) > 0) {
+		return false;
+	}
+
+	auto& function = entry->second;
+	if (function.lambda->parameters.size() != call.arguments.size()) return false;
+	for (auto& global : function.globals) {
+		if (bound(global)) return false;  // Shadowed where it is called.
+	}
+
+	assume(name);
+	inlining.push_back(name);
+	call.callee = clone(*function.lambda);
+	return true;
+}
+
+/**
+ * Keep a copy of a global function to inline at its calls, if its body is
+ * small and only refers to its parameters and globals. Functions that refer to
+ * themselves, create closures, or define locals are not inlined.
+ *
+ * @param name: name of the global.
+ * @param node: the function's lambda, before folding.
+ */
+void
+ConstantFolder::remember(const std::string& name, std::unique_ptr<Node> node)
+{
+	auto lambda = std::unique_ptr<Lambda>(static_cast<Lambda*>(node.release()));
+	if (lambda->body.empty()) return;
+
+	std::vector<std::string> globals;
+	size_t size = 0;
+	std::vector<Node*> pending;
+	for (auto& expression : lambda->body) pending.push_back(expression.get());
+
+	while (!pending.empty()) {
+		Node* current = pending.back();
+		pending.pop_back();
+		if (++size > INLINE_SIZE) return;
+
+		std::string reference;
+		switch (current->type) {
+			case node_type::LAMBDA:
+			case node_type::DEFINE:
+				return;
+			case node_type::SYMBOL:
+				reference = current->cast<Symbol>()->name;
+				break;
+			case node_type::SET:
+				reference = current->cast<Assignment>()->name;
+				break;
+			default:
+				break;
+		}
+		if (reference == name) return;
+		bool parameter = std::ranges::any_of(lambda->parameters, [&](Token& token) {
+			return token.string == reference;
+		});
+		if (!reference.empty() && !parameter) globals.push_back(reference);
+
+		for (auto child : children(*current)) pending.push_back(child->get());
+	}
+
+	lambda->self.clear();
+	functions.insert_or_assign(name, Inlinable{ .lambda = std::move(lambda), .globals = std::move(globals) });
+}
+
+/**
+ * Replace a subtree with a constant.
+ *
+ * @param node: slot holding the subtree.
+ * @param value: value of the subtree.
+ */
+void
+ConstantFolder::replace(std::unique_ptr<Node>& node, Value value)
+{
+	node = std::make_unique<Constant>(node->token, value);
+}
+
+/**
+ * Is this name a local or upvalue where it is used (i.e. not a global)?
+ *
+ * @param name: name to search for.
+ * @return: is the name bound by an enclosing lambda?
+ */
+bool
+ConstantFolder::bound(const std::string& name)
+{
+	for (auto& scope : scopes) {
+		if (std::ranges::count(scope, name) > 0) return true;
+	}
+	return false;
+}
+
+/**
+ * Can this subtree be removed without changing how the enclosing function is
+ * compiled? It must not capture anything the function does not otherwise
+ * capture (its upvalues have to stay the same if it is recompiled) or define
+ * locals. Errs on the side of keeping the subtree.
+ *
+ * @param node: subtree to examine.
+ * @return: can the subtree be dropped?
+ */
+bool
+ConstantFolder::droppable(Node& node)
+{
+	std::string name;
+	if (node.type == node_type::DEFINE) return false;
+	if (node.type == node_type::SYMBOL) name = node.cast<Symbol>()->name;
+	if (node.type == node_type::SET) name = node.cast<Assignment>()->name;
+
+	if (!name.empty()) {
+		for (size_t i = 0; i + 1 < scopes.size(); i++) {
+			if (std::ranges::count(scopes[i], name) > 0) return false;
+		}
+	}
+	if (node.type == node_type::LAMBDA) {
+		for (auto& reference : node.cast<Lambda>()->references) {
+			for (size_t i = 0; i + 1 < scopes.size(); i++) {
+				if (std::ranges::count(scopes[i], reference.string) > 0) return false;
+			}
+		}
+	}
+
+	for (auto child : children(node)) {
+		if (!droppable(**child)) return false;
+	}
+	return true;
+}
+
+/**
+ * Fold the expressions of a body, marking each one followed by another as
+ * unused if it has no side effects.
+ *
+ * @param body: expressions to fold, in order.
+ */
+void
+ConstantFolder::mark_unused(Program& body)
+{
+	for (size_t i = 0; i < body.size(); i++) {
+		fold(body[i]);
+		if (i + 1 < body.size() && body[i]->type != node_type::DEFINE) {
+			body[i]->unused = discardable(*body[i]);
+		}
+	}
+}
+
+/**
+ * Can this expression be left out if its value is unused? Operators it calls
+ * are relied on to be unchanged if so. Always no if the dead-code pass is
+ * disabled.
+ *
+ * @param node: expression, already folded.
+ * @return: does evaluating the expression have no effect besides its value?
+ */
+bool
+ConstantFolder::discardable(Node& node)
+{
+	if (!vm.optimizer().dead_code()) return false;
+	std::vector<std::string> operators;
+	if (!pure(node, operators)) return false;
+	for (auto& name : operators) assume(name);
+	return true;
+}
+
+/**
+ * Does evaluating an expression have no side effects, and never fail? A name
+ * must be bound, or a global that is already defined, and a call must be to
+ * an operator's builtin (which never fails with two arguments).
+ *
+ * @param node: expression, already folded.
+ * @param operators: names of the operators called, added to.
+ * @return: is the expression pure?
+ */
+bool
+ConstantFolder::pure(Node& node, std::vector<std::string>& operators)
+{
+	switch (node.type) {
+		case node_type::CONSTANT:
+		case node_type::LAMBDA:
+			return true;
+		case node_type::SYMBOL: {
+			auto& name = node.cast<Symbol>()->name;
+			return bound(name) || vm.check_global(name);
+			}
+		case node_type::IF:
+		case node_type::AND:
+		case node_type::OR:
+		case node_type::NOT:
+		case node_type::BEGIN:
+			break;
+		case node_type::CALL: {
+			auto call = node.cast<Call>();
+			if (call->callee->type != node_type::SYMBOL || call->arguments.size() != 2) return false;
+			auto& name = call->callee->cast<Symbol>()->name;
+			if (bound(name) || mutated.contains(name) || vm.pure_builtin(name) == nullptr) return false;
+			operators.push_back(name);
+			break;
+			}
+		default:
+			return false;
+	}
+
+	for (auto child : children(node)) {
+		if (!pure(**child, operators)) return false;
+	}
+	return true;
+}
+
+/**
+ * Record that the function being folded relies on a global being unchanged.
+ * Code inlined into a function is part of it. Top-level code runs once, so it
+ * does not need to be recorded.
+ *
+ * @param name: name of the global.
+ */
+void
+ConstantFolder::assume(const std::string& name)
+{
+	for (auto enclosing = lambdas.rbegin(); enclosing != lambdas.rend(); enclosing++) {
+		if (enclosing->inlined) continue;
+		auto& assumptions = enclosing->lambda->assumptions;
+		if (std::ranges::count(assumptions, name) == 0) assumptions.push_back(name);
+		return;
+	}
+}
+
+/**
+ * Stop treating a global as a constant or inlining it, and recompile in place
+ * every function that relied on it being unchanged - closures already created
+ * share the new bytecode. Must not be called while the VM is running.
+ *
+ * @param name: name of the global.
+ */
+void
+ConstantFolder::invalidate(const std::string& name)
+{
+	constants.erase(name);
+	functions.erase(name);
+
+	std::vector<Dependent> stale;
+	for (auto dependent = dependents.begin(); dependent != dependents.end();) {
+		if (std::ranges::count(dependent->assumptions, name) == 0) {
+			dependent++;
+			continue;
+		}
+		stale.push_back(std::move(*dependent));
+		dependent = dependents.erase(dependent);
+	}
+
+	for (auto& dependent : stale) {
+		auto node = std::unique_ptr<Lambda>(static_cast<Lambda*>(clone(*dependent.original).release()));
+		// The global the function is bound to may no longer hold it.
+		if (std::ranges::count(dependent.assumptions, node->self) > 0) {
+			if (node->self == name) node->self.clear();
+			else node->assumptions.push_back(node->self);
+		}
+		scopes.push_back(dependent.captured);
+		fold_lambda(*node);
+		scopes.pop_back();
+		Compiler::recompile(vm, dependent.function, *node, dependent.captured, dependent.copied);
+	}
+}
+
+/**
+ * Record a function compiled from a folded lambda, if folding relied on any
+ * globals being unchanged. The lambda keeps its original, as a body with a
+ * far jump is compiled twice (see Compiler::body).
+ *
+ * @param function: compiled function.
+ * @param node: lambda the function was compiled from.
+ * @param captured: names of the function's upvalues, in order.
+ * @param copied: whether each upvalue is copied into the closure.
+ */
+void
+ConstantFolder::depend(Function* function, Lambda& node, std::vector<std::string> captured,
+	std::vector<bool> copied)
+{
+	if (!node.original) return;
+	dependents.push_back(Dependent{
+		.function = function,
+		.original = std::unique_ptr<Lambda>(static_cast<Lambda*>(clone(*node.original).release())),
+		.assumptions = node.assumptions,
+		.captured = std::move(captured),
+		.copied = std::move(copied)
+		});
+}
+
+/**
+ * Forget functions the garbage collector is about to free. Called after
+ * marking and before sweeping.
+ */
+void
+ConstantFolder::sweep()
+{
+	std::erase_if(dependents, [](Dependent& dependent) {
+		return !dependent.function->reachable;
+	});
+}
@@ -0,0 +1,108 @@
+#ifndef LISP_FOLD_H
+#define LISP_FOLD_H
+
+#include "common.h"
+#include "ast.h"
+#include "value.h"
+
+struct Function;
+class VirtualMachine;
+
+/**
+ * AST pass that evaluates expressions whose result is known at compile time:
+ * operator calls on constants, logical operators, and ifs with a constant
+ * predicate.
+ *
+ * A global defined at the top level with a constant value is itself treated as
+ * a constant while nothing assigns to it with set. Functions that relied on
+ * this are recorded along with their unoptimized AST, and are recompiled in
+ * place once a later REPL line assigns to the global. Calls to operators
+ * likewise depend on the operator's global still holding the builtin, and a
+ * function defined at the top level on its global still holding it (see
+ * Lambda::self).
+ *
+ * Lambdas called where they are written (e.g. a let) are folded as part of the
+ * enclosing function, as the Compiler inlines them. At -O2, calls to small
+ * global functions defined the same way as constants are inlined too, relying
+ * on the global like a constant.
+ *
+ * A lazy lambda is folded when its body is parsed, on the function's first
+ * call - nothing relies on globals before then.
+ *
+ * Unless the dead-code pass is disabled, expressions whose values are unused
+ * are marked (see Node::unused) if they have no side effects: those followed
+ * by another expression in a body, and definitions of locals that are never
+ * referred to. Calls to operators count if the operator's global still holds
+ * the builtin, which is relied on like a constant.
+ */
+class ConstantFolder {
+private:
+	/**
+	 * Function compiled from folded code, with what is needed to compile it
+	 * again without the assumptions it made.
+	 */
+	struct Dependent {
+		Function* function;
+		std::unique_ptr<Lambda> original;
+		std::vector<std::string> assumptions;  // Globals expected to be unchanged.
+		std::vector<std::string> captured;  // Names of upvalues, in order.
+		std::vector<bool> copied;  // Is each upvalue copied into the closure?
+	};
+
+	/**
+	 * Copy of a global function to inline, taken before folding, with the
+	 * globals its body refers to - these must not be shadowed where inlined.
+	 */
+	struct Inlinable {
+		std::unique_ptr<Lambda> lambda;
+		std::vector<std::string> globals;
+	};
+
+	/* Lambda being folded, and whether it is inlined into the enclosing one. */
+	struct Enclosing {
+		Lambda* lambda;
+		bool inlined;
+	};
+
+	// Most nodes in the body of a global function that is inlined.
+	static constexpr size_t INLINE_SIZE = 16;
+
+	VirtualMachine& vm;
+	std::unordered_map<std::string, Value> constants;
+	std::unordered_set<std::string> mutated;  // Globals ever targeted by set
+	std::vector<Dependent> dependents;
+	std::unordered_map<std::string, Inlinable> functions;
+	std::vector<std::string> inlining;  // Global functions being inlined.
+	std::vector<std::string> unconfirmed;  // Globals the last line defined, checked by the next.
+
+	// Names bound by each enclosing lambda, innermost last, and the lambdas.
+	std::vector<std::vector<std::string>> scopes;
+	std::vector<Enclosing> lambdas;
+
+	void scan(Node& node, std::unordered_map<std::string, int>& defines,
+		std::vector<std::string>& assigned);
+	void fold(std::unique_ptr<Node>& node);
+	void fold_lambda(Lambda& node, bool inlined = false);
+	void fold_if(std::unique_ptr<Node>& node);
+	void fold_logical(std::unique_ptr<Node>& node);
+	void fold_call(std::unique_ptr<Node>& node);
+	bool inline_global(Call& call);
+	void remember(const std::string& name, std::unique_ptr<Node> node);
+	void replace(std::unique_ptr<Node>& node, Value value);
+	bool bound(const std::string& name);
+	bool droppable(Node& node);
+	void mark_unused(Program& body);
+	bool discardable(Node& node);
+	bool pure(Node& node, std::vector<std::string>& operators);
+	void assume(const std::string& name);
+	void invalidate(const std::string& name);
+public:
+	void run(Program& program);
+	void fold_lazy(Lambda& node, const std::vector<std::string>& captured);
+	void depend(Function* function, Lambda& node, std::vector<std::string> captured,
+		std::vector<bool> copied);
+	void sweep();
+	ConstantFolder(VirtualMachine& vm) : vm{ vm } {}
+};
+
+#endif
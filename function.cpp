@@ -20,18 +20,8 @@ Function::size()
 size_t
 Closure::size()
 {
-	return sizeof(*this);
-}
-
-/**
- * Convenience function for retrieving shared pointer to enclosed function.
- * 
- * @return: shared pointer to enclosed function.
- */
-std::shared_ptr<Function>
-Closure::function_ptr()
-{
-	return std::any_cast<std::shared_ptr<Function>>(function->data);
+	return sizeof(*this) + upvalues.capacity() * sizeof(upvalues[0]) +
+		captures.capacity() * sizeof(captures[0]);
 }
 
 
@@ -39,16 +29,15 @@ Closure::function_ptr()
  * Generates (and allocates in VM memory) a Pair data structure.
  * 
  * @param args: stack location of first argument.
- * @param count: number of arguments - must be 2.
+ * @param count: number of arguments - always 2.
  * @return: Value with a pointer to the newly allocated Pair.
  */
 Value
-BuiltinCons::call(std::vector<Value>::iterator args, size_t count)
+BuiltinCons::call(Value* args, [[maybe_unused]] size_t count)
 {
-	if (count != 2) return Value(value_type::NIL);  // TEMP
 	Value left = *args++;
 	Value right = *args++;
-	return vm->allocate(Pair(left, right));
+	return vm->allocate<Pair>(left, right);
 }
 
 // TODO: support for variable number of arguments
@@ -57,58 +46,113 @@ BuiltinCons::call(std::vector<Value>::iterator args, size_t count)
  * Adds numeric Values and returns the sum.
  * 
  * @param args: stack location of first argument.
- * @param count: number of arguments.
+ * @param count: number of arguments - always 2.
  * @return: Value - numeric.
  */
 Value
-BuiltinAdd::call(std::vector<Value>::iterator args, size_t count)
+BuiltinAdd::call(Value* args, [[maybe_unused]] size_t count)
 {
-	if (count != 2) return Value(value_type::NIL);  // TEMP
 	Value left = *args++;
 	Value right = *args++;
 
-	if (left.type != value_type::NUMBER) return Value(value_type::NIL);  // TEMP
-	if (right.type != value_type::NUMBER) return Value(value_type::NIL);  // TEMP
+	if (!left.match_type(value_type::NUMBER)) return Value(value_type::NIL);  // TEMP
+	if (!right.match_type(value_type::NUMBER)) return Value(value_type::NIL);  // TEMP
 
-	return Value(left.as.number + right.as.number);
+	return Value(left.as_number() + right.as_number());
 }
 
 /**
  * Subtract right-hand value from left-hand value.
  *
  * @param args: stack location of first argument.
- * @param count: number of arguments.
+ * @param count: number of arguments - always 2.
+ * @return: Value - numeric.
+ */
+Value
+BuiltinSubtract::call(Value* args, [[maybe_unused]] size_t count)
+{
+	Value left = *args++;
+	Value right = *args++;
+
+	if (!left.match_type(value_type::NUMBER)) return Value(value_type::NIL);  // TEMP
+	if (!right.match_type(value_type::NUMBER)) return Value(value_type::NIL);  // TEMP
+
+	return Value(left.as_number() - right.as_number());
+}
+
+/**
+ * Multiplies numeric Values and returns the product.
+ *
+ * @param args: stack location of first argument.
+ * @param count: number of arguments - always 2.
  * @return: Value - numeric.
  */
 Value
-BuiltinSubtract::call(std::vector<Value>::iterator args, size_t count)
+BuiltinMultiply::call(Value* args, [[maybe_unused]] size_t count)
 {
-	if (count != 2) return Value(value_type::NIL);  // TEMP
 	Value left = *args++;
 	Value right = *args++;
 
-	if (left.type != value_type::NUMBER) return Value(value_type::NIL);  // TEMP
-	if (right.type != value_type::NUMBER) return Value(value_type::NIL);  // TEMP
+	if (!left.match_type(value_type::NUMBER)) return Value(value_type::NIL);  // TEMP
+	if (!right.match_type(value_type::NUMBER)) return Value(value_type::NIL);  // TEMP
 
-	return Value(left.as.number - right.as.number);
+	return Value(left.as_number() * right.as_number());
 }
 
 /**
  * Tests numeric values for equality.
  *
  * @param args: stack location of first argument.
- * @param count: number of arguments.
+ * @param count: number of arguments - always 2.
  * @return: Value with boolean - are the arguments equal?
  */
 Value
-BuiltinEqual::call(std::vector<Value>::iterator args, size_t count)
+BuiltinEqual::call(Value* args, [[maybe_unused]] size_t count)
 {
-	if (count != 2) return Value(value_type::NIL);  // TEMP
 	Value left = *args++;
 	Value right = *args++;
 
-	if (left.type != value_type::NUMBER) return Value(value_type::NIL);  // TEMP
-	if (right.type != value_type::NUMBER) return Value(value_type::NIL);  // TEMP
+	if (!left.match_type(value_type::NUMBER)) return Value(value_type::NIL);  // TEMP
+	if (!right.match_type(value_type::NUMBER)) return Value(value_type::NIL);  // TEMP
 
-	return Value(left.as.number == right.as.number);
+	return Value(left.as_number() == right.as_number());
 }
+
+
+/**
+ * Tests whether left-hand numeric value is smaller than the right-hand one.
+ *
+ * @param args: stack location of first argument.
+ * @param count: number of arguments - always 2.
+ * @return: Value with boolean - is left < right?
+ */
+Value
+BuiltinLess::call(Value* args, [[maybe_unused]] size_t count)
+{
+	Value left = *args++;
+	Value right = *args++;
+
+	if (!left.match_type(value_type::NUMBER)) return Value(value_type::NIL);  // TEMP
+	if (!right.match_type(value_type::NUMBER)) return Value(value_type::NIL);  // TEMP
+
+	return Value(left.as_number() < right.as_number());
+}
+
+/**
+ * Tests whether left-hand numeric value is greater than the right-hand one.
+ *
+ * @param args: stack location of first argument.
+ * @param count: number of arguments - always 2.
+ * @return: Value with boolean - is left > right?
+ */
+Value
+BuiltinGreater::call(Value* args, [[maybe_unused]] size_t count)
+{
+	Value left = *args++;
+	Value right = *args++;
+
+	if (!left.match_type(value_type::NUMBER)) return Value(value_type::NIL);  // TEMP
+	if (!right.match_type(value_type::NUMBER)) return Value(value_type::NIL);  // TEMP
+
+	return Value(left.as_number() > right.as_number());
+}
\ No newline at end of file
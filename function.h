@@ -11,50 +11,59 @@ class VirtualMachine;
 
 /**
  * Runtime closure representation - contains function and enclosed variables.
+ * Variables that are never assigned to are copied into 'captures' when the
+ * closure is created; the rest are shared with the enclosing scope through
+ * 'upvalues'.
  * 
  * @param function: pointer to the function in runtime memory.
  */
-struct Closure
+struct Closure : Data
 {
-	Data* function;
-	std::shared_ptr<Function> function_ptr();
-	std::vector<std::shared_ptr<RuntimeUpvalue>> upvalues;
+	Function* function;
+	std::vector<RuntimeUpvalue*> upvalues;
+	std::vector<Value> captures;
 	size_t size();
-	Closure(Data* function) : function{ function } {};
+	Closure(Function* function) : Data(data_type::CLOSURE), function{ function } {};
 };
 
 /**
  * Runtime function representation - stores information needed for calling the
  * function, and representing closures that enclose this function.
  */
-struct Function
+struct Function : Data
 {
 	size_t arity = 0;
 	size_t upvalues = 0;
+	size_t captures = 0;  // Variables copied into the closure.
+	size_t stack_size = 0;  // Stack slots needed beyond the arguments.
+	bool lazy = false;  // Body compiled on the first call - see Compiler::defer_body.
 	Chunk bytecode;
 	std::string name;
 	bool anonymous() { return name.size() == 0; }
 	size_t size();
-	Function() : bytecode{ Chunk(0) } {}  // TEMP
+	Function() : Data(data_type::FUNCTION), bytecode{ Chunk(0) } {}  // TEMP
 };
 
 // TODO: give this some way of throwing an error
 
 /**
  * Interface for built-in functions (e.g., addition). These are implemented in
- * C++ and can be called during runtime.
+ * C++ and can be called during runtime. The VM checks the number of arguments
+ * against 'arity' before calling.
  */
-struct BuiltinFunction 
+struct BuiltinFunction : Data
 {
 protected:
 	VirtualMachine* vm;
 	std::string func_name;
-	BuiltinFunction(VirtualMachine* vm, std::string func_name)
-		: vm{ vm }, func_name{ func_name } {};
+	BuiltinFunction(VirtualMachine* vm, std::string func_name, size_t arity)
+		: Data(data_type::BUILTIN), vm{ vm }, func_name{ func_name }, arity{ arity } {};
 public:
+	const size_t arity;
 	std::string name() { return func_name; };
 	size_t size() { return sizeof(*this); }
-	virtual Value call(std::vector<Value>::iterator args, size_t count) = 0;
+	virtual Value call(Value* args, size_t count) = 0;
+	virtual ~BuiltinFunction() = default;
 };
 
 /**
@@ -63,8 +72,8 @@ public:
  */
 struct BuiltinCons : BuiltinFunction
 {
-	Value call(std::vector<Value>::iterator args, size_t count);
-	BuiltinCons(VirtualMachine* vm) : BuiltinFunction(vm, "cons") {};
+	Value call(Value* args, size_t count);
+	BuiltinCons(VirtualMachine* vm) : BuiltinFunction(vm, "cons", 2) {};
 };
 
 /**
@@ -72,8 +81,8 @@ struct BuiltinCons : BuiltinFunction
  */
 struct BuiltinAdd : BuiltinFunction
 {
-	Value call(std::vector<Value>::iterator args, size_t count);
-	BuiltinAdd() : BuiltinFunction(nullptr, "+") {};
+	Value call(Value* args, size_t count);
+	BuiltinAdd() : BuiltinFunction(nullptr, "+", 2) {};
 };
 
 /**
@@ -81,16 +90,41 @@ struct BuiltinAdd : BuiltinFunction
  */
 struct BuiltinSubtract : BuiltinFunction
 {
-	Value call(std::vector<Value>::iterator args, size_t count);
-	BuiltinSubtract() : BuiltinFunction(nullptr, "-") {};
+	Value call(Value* args, size_t count);
+	BuiltinSubtract() : BuiltinFunction(nullptr, "-", 2) {};
+};
+
+/**
+ * Supports multiplication.
+ */
+struct BuiltinMultiply : BuiltinFunction
+{
+	Value call(Value* args, size_t count);
+	BuiltinMultiply() : BuiltinFunction(nullptr, "*", 2) {};
 };
 
 /**
  * Supports test for equality.
  */
 struct BuiltinEqual : BuiltinFunction {
-	Value call(std::vector<Value>::iterator args, size_t count);
-	BuiltinEqual(): BuiltinFunction(nullptr, "=") {};
+	Value call(Value* args, size_t count);
+	BuiltinEqual(): BuiltinFunction(nullptr, "=", 2) {};
+};
+
+/**
+ * Supports numeric comparison - is the left-hand value smaller?
+ */
+struct BuiltinLess : BuiltinFunction {
+	Value call(Value* args, size_t count);
+	BuiltinLess(): BuiltinFunction(nullptr, "<", 2) {};
+};
+
+/**
+ * Supports numeric comparison - is the left-hand value greater?
+ */
+struct BuiltinGreater : BuiltinFunction {
+	Value call(Value* args, size_t count);
+	BuiltinGreater(): BuiltinFunction(nullptr, ">", 2) {};
 };
 
 #endif
\ No newline at end of file
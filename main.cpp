@@ -44,13 +44,57 @@ repl(VirtualMachine& vm)
 	}
 }
 
+/**
+ * Print command line options.
+ * 
+ * @param program: name the program was run as.
+ */
+void
+usage(const char* program)
+{
+	std::cerr << "usage: " << program << " [-O0|-O1|-O2] [--time-passes] [--code-size]"
+		<< " [--disable-pass=<name>] [--lazy] [--call-sites]\n"
+		<< "  -O<n>                  optimization level (default -O" << PassManager::MAX_LEVEL << ")\n"
+		<< "  --time-passes          report time spent in each compiler pass on exit\n"
+		<< "  --code-size            report bytecode size after each compiler pass, and dead\n"
+		<< "                         code removed from each function, on exit\n"
+		<< "  --disable-pass=<name>  don't run a compiler pass, e.g. compact\n"
+		<< "  --lazy                 parse and compile functions when first called\n"
+		<< "  --call-sites           report call site feedback on exit\n";
+}
+
 // TODO: runfile
 // NB: temporarily simulating this using the shell
 
 int
-main(void)
+main(int argc, char* argv[])
 {
 	VirtualMachine vm;
+	bool call_sites = false;
+
+	for (int i = 1; i < argc; i++) {
+		std::string option = argv[i];
+		if (option.size() == 3 && option.starts_with("-O") &&
+			option[2] >= '0' && option[2] <= '0' + PassManager::MAX_LEVEL) {
+			vm.optimizer().set_level(option[2] - '0');
+		}
+		else if (option == "--time-passes") vm.optimizer().enable_timing();
+		else if (option == "--code-size") vm.optimizer().enable_sizes();
+		else if (option.starts_with("--disable-pass=")) {
+			vm.optimizer().disable(option.substr(option.find('=') + 1));
+		}
+		else if (option == "--lazy") vm.optimizer().enable_lazy();
+		else if (option == "--call-sites") call_sites = true;
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
 	repl(vm);
+
+	vm.optimizer().report(std::cerr);
+	if (call_sites) vm.print_call_sites();
+	vm.print_opcode_pairs();  // Only if built with PROFILE_OPCODE_PAIRS.
 	return 0;
 }
@@ -0,0 +1,197 @@
+#include "optimizer.h"
+#include "function.h"
+#include "peephole.h"
+#include "vm.h"
+
+/**
+ * Register the optimization pipeline. Passes run in the order they are added.
+ * Level 0 passes are required for correct execution and always run.
+ *
+ * @param vm: VM the compiled code will run on.
+ */
+PassManager::PassManager(VirtualMachine& vm) : folder{ vm }
+{
+	add_pass("constant-folding", 1, [this](Program& program) {
+		folder.run(program);
+	});
+
+	// Proper tail calls are part of the language, not an optimization.
+	add_pass("tail-calls", 0, [](Function& function) {
+		function.bytecode.tail_call_optimize();
+	});
+	add_pass("peephole", 1, [](Function& function) {
+		PeepholeOptimizer(function.bytecode).optimize();
+	});
+	// Unused values are dropped as the code is generated - see Compiler::drop.
+	add_pass("dead-code", 1, [this](Function& function) {
+		dead_bytes += PeepholeOptimizer(function.bytecode).eliminate();
+	});
+	add_pass("superinstructions", 2, [](Function& function) {
+		PeepholeOptimizer(function.bytecode).fuse();
+	});
+	add_pass("compact", 1, [](Function& function) {
+		PeepholeOptimizer(function.bytecode).compact();
+	});
+}
+
+/**
+ * Add a pass over the AST of each REPL line.
+ *
+ * @param name: name used when reporting timing.
+ * @param level: minimum optimization level the pass runs at.
+ * @param run: the pass.
+ */
+void
+PassManager::add_pass(std::string name, int level, std::function<void(Program&)> run)
+{
+	ast_passes.push_back(AstPass{ .name = name, .level = level, .run = run });
+}
+
+/**
+ * Add a pass over the bytecode of each compiled function.
+ *
+ * @param name: name used when reporting timing.
+ * @param level: minimum optimization level the pass runs at.
+ * @param run: the pass.
+ */
+void
+PassManager::add_pass(std::string name, int level, std::function<void(Function&)> run)
+{
+	bytecode_passes.push_back(BytecodePass{ .name = name, .level = level, .run = run });
+}
+
+/**
+ * Run the AST passes enabled at the current optimization level.
+ *
+ * @param program: AST of a REPL line, rewritten in place.
+ */
+void
+PassManager::run(Program& program)
+{
+	for (auto& pass : ast_passes) {
+		if (!enabled(pass.name, pass.level)) continue;
+		time(pass.name, [&]() { pass.run(program); });
+	}
+}
+
+/**
+ * Run the AST passes on the body of a lazy function, just parsed on its first
+ * call. Constant folding is the only AST pass, and folds the body as part of
+ * the line it was written in.
+ *
+ * @param node: lazy lambda with its body, rewritten in place.
+ * @param captured: names of the function's upvalues.
+ */
+void
+PassManager::run(Lambda& node, const std::vector<std::string>& captured)
+{
+	if (!enabled("constant-folding", 1)) return;
+	time("constant-folding", [&]() { folder.fold_lazy(node, captured); });
+}
+
+/**
+ * Run the bytecode passes enabled at the current optimization level.
+ *
+ * @param function: function whose bytecode is complete.
+ * @param name: name to report dead code removed from the function under.
+ * @param dropped: bytes of unused code already left out by the Compiler.
+ */
+void
+PassManager::run(Function& function, const std::string& name, size_t dropped)
+{
+	dead_bytes = dropped;
+	if (sizing) measure("generated", function.bytecode.instructions.size());
+	for (auto& pass : bytecode_passes) {
+		if (!enabled(pass.name, pass.level)) continue;
+		time(pass.name, [&]() { pass.run(function); });
+		if (sizing) measure(pass.name, function.bytecode.instructions.size());
+	}
+	if (sizing && dead_bytes > 0) removed.push_back(Size{ .name = name, .bytes = dead_bytes });
+}
+
+/**
+ * @param name: name of a pass.
+ * @param level: minimum optimization level the pass runs at.
+ * @return: does the pass run? Passes needed at level 0 can't be disabled.
+ */
+bool
+PassManager::enabled(const std::string& name, int level)
+{
+	if (level > optimization_level) return false;
+	return level == 0 || !disabled.contains(name);
+}
+
+/**
+ * Add time spent in a pass or phase to its total.
+ *
+ * @param name: name of the pass or phase.
+ * @param elapsed: time spent in one run.
+ */
+void
+PassManager::record(const std::string& name, std::chrono::steady_clock::duration elapsed)
+{
+	for (auto& entry : timings) {
+		if (entry.name == name) {
+			entry.total += elapsed;
+			entry.runs++;
+			return;
+		}
+	}
+	timings.push_back(Timing{ .name = name, .total = elapsed, .runs = 1 });
+}
+
+/**
+ * Add the size of a function's bytecode after a pass to the pass's total.
+ *
+ * @param name: name of the pass, or "generated" before any pass.
+ * @param bytes: size of the bytecode.
+ */
+void
+PassManager::measure(const std::string& name, size_t bytes)
+{
+	for (auto& entry : sizes) {
+		if (entry.name == name) {
+			entry.bytes += bytes;
+			return;
+		}
+	}
+	sizes.push_back(Size{ .name = name, .bytes = bytes });
+}
+
+/**
+ * Print the total time spent in each pass or phase, if timing is enabled.
+ * Code generation includes the bytecode passes run during it. Then print the
+ * total bytecode size after each bytecode pass, and the dead code removed from
+ * each function, if sizes are enabled.
+ *
+ * @param out: stream to print to.
+ */
+void
+PassManager::report(std::ostream& out)
+{
+	if (timing) {
+		out << "== PASS TIMING (-O" << optimization_level << ") ==\n";
+		for (auto& entry : timings) {
+			auto microseconds = std::chrono::duration_cast<std::chrono::microseconds>(entry.total);
+			out << std::left << std::setfill(' ') << std::setw(20) << entry.name
+				<< std::right << std::setw(10) << microseconds.count() << " us"
+				<< std::setw(8) << entry.runs << " runs\n";
+		}
+	}
+
+	if (sizing) {
+		out << "== BYTECODE SIZE (-O" << optimization_level << ") ==\n";
+		for (auto& entry : sizes) {
+			out << std::left << std::setfill(' ') << std::setw(20) << entry.name
+				<< std::right << std::setw(10) << entry.bytes << " bytes\n";
+		}
+	}
+
+	if (sizing && !removed.empty()) {
+		out << "== DEAD CODE REMOVED (-O" << optimization_level << ") ==\n";
+		for (auto& entry : removed) {
+			out << std::left << std::setfill(' ') << std::setw(20) << entry.name
+				<< std::right << std::setw(10) << entry.bytes << " bytes\n";
+		}
+	}
+}
@@ -0,0 +1,107 @@
+#ifndef LISP_OPTIMIZER_H
+#define LISP_OPTIMIZER_H
+
+#include "common.h"
+#include "ast.h"
+#include "fold.h"
+
+struct Function;
+class VirtualMachine;
+
+/**
+ * Runs optimization passes between parsing and execution. AST passes rewrite
+ * the tree for a whole REPL line before bytecode is generated; bytecode passes
+ * run on each function once its bytecode is complete. A pass only runs if the
+ * optimization level is at least the pass's level.
+ *
+ * Optionally records the time spent in each pass (and in parsing and code
+ * generation) across the whole session, and the total size of the bytecode
+ * after each bytecode pass, along with the bytes of dead code removed from
+ * each function. Passes can also be disabled by name.
+ *
+ * In lazy mode, the bodies of functions are only parsed and compiled (and the
+ * passes run on them) when they are first called.
+ */
+class PassManager {
+private:
+	struct AstPass {
+		std::string name;
+		int level;
+		std::function<void(Program&)> run;
+	};
+	struct BytecodePass {
+		std::string name;
+		int level;
+		std::function<void(Function&)> run;
+	};
+
+	struct Timing {
+		std::string name;
+		std::chrono::steady_clock::duration total{ 0 };
+		size_t runs = 0;
+	};
+	struct Size {
+		std::string name;
+		size_t bytes = 0;
+	};
+
+	std::vector<AstPass> ast_passes;
+	std::vector<BytecodePass> bytecode_passes;
+	int optimization_level = 2;
+	bool timing = false;
+	std::vector<Timing> timings;  // In order of first use.
+	bool sizing = false;
+	std::vector<Size> sizes;  // Bytecode bytes after each pass, in order of first use.
+	std::vector<Size> removed;  // Dead code bytes removed from each function, in order.
+	size_t dead_bytes = 0;  // Removed from the function being optimized so far.
+	std::unordered_set<std::string> disabled;
+	bool lazy_compilation = false;
+	ConstantFolder folder;
+	void record(const std::string& name, std::chrono::steady_clock::duration elapsed);
+	void measure(const std::string& name, size_t bytes);
+	bool enabled(const std::string& name, int level);
+public:
+	static constexpr int MAX_LEVEL = 2;
+	void add_pass(std::string name, int level, std::function<void(Program&)> run);
+	void add_pass(std::string name, int level, std::function<void(Function&)> run);
+	void run(Program& program);
+	void run(Lambda& node, const std::vector<std::string>& captured);
+	void run(Function& function, const std::string& name, size_t dropped);
+	void set_level(int level) { optimization_level = level; }
+	int level() { return optimization_level; }
+	void enable_timing() { timing = true; }
+	void enable_sizes() { sizing = true; }
+	void disable(const std::string& name) { disabled.insert(name); }
+	void enable_lazy() { lazy_compilation = true; }
+	bool lazy() { return lazy_compilation; }
+	bool infer_types() { return enabled("type-inference", 1); }
+	bool dead_code() { return enabled("dead-code", 1); }
+	void report(std::ostream& out);
+	ConstantFolder& constants() { return folder; }
+
+	/**
+	 * Run a compilation phase, recording its time if timing is enabled.
+	 *
+	 * @param name: name to report the time under.
+	 * @param phase: callable to run.
+	 * @return: result of the phase.
+	 */
+	template <typename F>
+	auto time(const std::string& name, F phase) {
+		if (!timing) return phase();
+		auto start = std::chrono::steady_clock::now();
+		if constexpr (std::is_void_v<decltype(phase())>) {
+			phase();
+			record(name, std::chrono::steady_clock::now() - start);
+		}
+		else {
+			auto result = phase();
+			record(name, std::chrono::steady_clock::now() - start);
+			return result;
+		}
+	}
+
+	PassManager(VirtualMachine& vm);
+};
+
+#endif
@@ -0,0 +1,446 @@
+#include "parser.h"
+
+/**
+ * Parse the source into a list of top-level expressions.
+ *
+ * @return: AST for each top-level expression. Only valid if error() is false.
+ */
+Program
+Parser::parse()
+{
+	Program program;
+
+	advance();
+	while (scanner.current.type != token_type::END) {
+		program.push_back(expression());
+	}
+	return program;
+}
+
+/**
+ * Move forward one token. Retain previous token in case it is needed to parse
+ * current token. Contains under-construction error strategy - idea is to
+ * support recovery to the next non-error statement if possible.
+ */
+void
+Parser::advance()
+{
+	// TODO: reset panic mode at next definition or expression?
+	for (;;) {  // If an error is encountered, go to next non-error token.
+		scanner.advance();
+		if (scanner.current.type != token_type::ERROR) break;
+		error("Unrecognized token " + scanner.current.string, scanner.current);
+	}
+}
+
+/**
+ * Advance one token if it is what is expected or indicate an error otherwise.
+ *
+ * @param expected: next token type required.
+ * @param error_message: error message if token is not expected type.
+ */
+void
+Parser::consume(token_type expected, std::string error_message)
+{
+	if (scanner.current.type == expected) advance();
+	else error(error_message, scanner.current);
+}
+
+/**
+ * Display error to user and indicate that program is invalid, preventing the
+ * program from being compiled.
+ *
+ * @param error_message: message to display to user.
+ * @param token: token where error was encountered.
+ */
+void
+Parser::error(std::string error_message, Token token)
+{
+	if (panic_mode) return;
+	std::cerr << "Compiler error [line " << token.line << "] " << error_message << " ";
+	std::cerr << token.string << '\n';
+	had_error = true;
+	panic_mode = true;
+}
+
+/**
+ * Parse the next expression - may be self-evaluating or a combination.
+ *
+ * @return: AST for the expression.
+ */
+std::unique_ptr<Node>
+Parser::expression()
+{
+	advance();
+	switch (scanner.previous.type) {
+		case token_type::NUMBER:
+			return constant(Value(std::stod(scanner.previous.string)));
+		case token_type::SYMBOL:
+			return std::make_unique<Symbol>(scanner.previous);
+		case token_type::FALSE:
+			return constant(Value(false));
+		case token_type::TRUE:
+			return constant(Value(true));
+		case token_type::NIL:
+			return constant(Value(value_type::NIL));
+		case token_type::LPAREN: {
+			std::unique_ptr<Node> node;
+			if (scanner.current.type == token_type::RPAREN) node = constant(Value(value_type::NIL));
+			else node = combination();
+			consume(token_type::RPAREN, "Expect ')'.");
+			return node;
+			}
+		default:
+			error("unknown self-evaluating token type", scanner.previous);
+			return constant(Value(value_type::NIL));
+	}
+}
+
+/**
+ * Parse a combination - special forms are handled using specific tokens, and
+ * other built-ins and user-defined functions are handled generally - the
+ * function may itself be a combination, e.g. a lambda applied straight away.
+ * '()' for 'NIL' is supported but is handled elsewhere.
+ *
+ * @return: AST for the combination.
+ */
+std::unique_ptr<Node>
+Parser::combination()
+{
+	advance();
+	switch (scanner.previous.type) {
+		case token_type::NOT:
+			return logical(node_type::NOT);
+		case token_type::AND:
+			return logical(node_type::AND);
+		case token_type::OR:
+			return logical(node_type::OR);
+		case token_type::DEFINE:
+			return assignment(node_type::DEFINE);
+		case token_type::SET:
+			return assignment(node_type::SET);
+		case token_type::LAMBDA:
+			return lambda();
+		case token_type::LET:
+			return let();
+		case token_type::DO:
+			return _do();
+		case token_type::IF:
+			return _if();
+		case token_type::SYMBOL:  // It's a (non special form) function call.
+			return call(scanner.previous, std::make_unique<Symbol>(scanner.previous));
+		case token_type::LPAREN: {  // The callee is a combination too, e.g. a lambda.
+			Token token = scanner.previous;
+			std::unique_ptr<Node> callee;
+			if (scanner.current.type == token_type::LAMBDA) {
+				advance();
+				callee = lambda(true);
+			}
+			else if (scanner.current.type == token_type::RPAREN) callee = constant(Value(value_type::NIL));
+			else callee = combination();
+			consume(token_type::RPAREN, "Expect ')'.");
+			return call(token, std::move(callee));
+			}
+		default:
+			error("expected symbol when reading combination", scanner.previous);
+			return constant(Value(value_type::NIL));
+	}
+}
+
+/**
+ * Wrap a self-evaluating value in a node.
+ *
+ * @param value: Value of constant.
+ * @return: AST for the constant.
+ */
+std::unique_ptr<Node>
+Parser::constant(Value value)
+{
+	return std::make_unique<Constant>(scanner.previous, value);
+}
+
+/**
+ * Parse a definition or an assignment - a symbol followed by its new value.
+ *
+ * @param type: DEFINE or SET.
+ * @return: AST for the definition or assignment.
+ */
+std::unique_ptr<Node>
+Parser::assignment(node_type type)
+{
+	consume(token_type::SYMBOL, "Expect symbol.");
+	Token token = scanner.previous;
+	return std::make_unique<Assignment>(type, token, token.string, expression());
+}
+
+/**
+ * Parse an anonymous function - a parameter list followed by the body.
+ *
+ * @param immediate: is the function called straight away? Its body is parsed
+ *                   now even in lazy mode, like the body of a let.
+ * @return: AST for the function.
+ */
+std::unique_ptr<Node>
+Parser::lambda(bool immediate)
+{
+	auto node = std::make_unique<Lambda>(scanner.previous);
+
+	consume(token_type::LPAREN, "Expected '(' before function parameters");
+	while (scanner.current.type != token_type::RPAREN) {
+		if (scanner.current.type != token_type::SYMBOL) {
+			error("Expect symbol parameter", scanner.current);
+			break;
+		}
+		advance();
+		parameter(*node);
+	}
+	consume(token_type::RPAREN, "Expected ')' after function parameters");
+
+	if (lazy && !immediate) {
+		skip_body(*node);
+		return node;
+	}
+	while (scanner.current.type != token_type::RPAREN && scanner.current.type != token_type::END) {
+		node->body.push_back(expression());
+	}
+	return node;
+}
+
+/**
+ * Scan the body of a function up to its closing ')' without parsing it,
+ * keeping its source to parse when the function is first called. The names
+ * the body refers to are all the enclosing function needs to create closures
+ * of it, and the names it sets are needed by passes over the enclosing code.
+ * Both err on the side of including a name, as nested scopes aren't known.
+ * A small body is parsed straight away instead.
+ *
+ * @param node: function whose parameters have just been parsed.
+ */
+void
+Parser::skip_body(Lambda& node)
+{
+	size_t start = scanner.offset();
+	size_t depth = 0;
+	size_t tokens = 0;
+	bool set = false;
+	std::unordered_set<size_t> seen;
+	for (auto& parameter : node.parameters) seen.insert(parameter.symbol);
+
+	while (scanner.current.type != token_type::END &&
+		(depth > 0 || scanner.current.type != token_type::RPAREN)) {
+		Token& token = scanner.current;
+		if (token.type == token_type::LPAREN) depth++;
+		if (token.type == token_type::RPAREN) depth--;
+		if (token.type == token_type::SYMBOL) {
+			if (set) node.assigned.push_back(token);
+			if (seen.insert(token.symbol).second) node.references.push_back(token);
+		}
+		set = token.type == token_type::SET;
+		tokens++;
+		advance();
+	}
+
+	node.source = scanner.text(start);
+	if (tokens >= LAZY_TOKENS) return;
+
+	Scanner body_scanner(node.source);
+	Parser body_parser(body_scanner, true);
+	node.body = body_parser.parse();
+	had_error = had_error || body_parser.error();
+	node.source.clear();
+	node.references.clear();
+	node.assigned.clear();
+}
+
+/**
+ * Add the symbol just consumed to a function's parameters.
+ *
+ * @param node: function the parameter belongs to.
+ */
+void
+Parser::parameter(Lambda& node)
+{
+	for (auto& parameter : node.parameters) {
+		if (parameter.symbol == scanner.previous.symbol) {
+			error("Unexpected duplicate token", scanner.previous);
+		}
+	}
+	node.parameters.push_back(scanner.previous);
+}
+
+/**
+ * Parse a let - bindings followed by a body, which becomes a function of the
+ * bound variables applied to their initial values. A named let also binds the
+ * name to that function within the body, so the body can loop by calling it.
+ *
+ * @return: AST for the let.
+ */
+std::unique_ptr<Node>
+Parser::let()
+{
+	Token token = scanner.previous;
+	bool named = scanner.current.type == token_type::SYMBOL;
+	if (named) advance();
+	Token name = scanner.previous;
+
+	auto function = std::make_unique<Lambda>(token);
+	Program values;
+	bindings(*function, values, nullptr);
+	while (scanner.current.type != token_type::RPAREN && scanner.current.type != token_type::END) {
+		function->body.push_back(expression());
+	}
+
+	if (named) return loop(name, std::move(function), std::move(values));
+	auto node = std::make_unique<Call>(token, std::move(function));
+	node->arguments = std::move(values);
+	return node;
+}
+
+/**
+ * Parse a do loop - bindings with optional step expressions, then a test
+ * followed by the expressions giving the result once the test is true, then
+ * the body run on each iteration while it is false. Variables without a step
+ * keep their value.
+ *
+ * It becomes a named let whose body is an if: the result when the test is true,
+ * otherwise the body followed by a call with the steps. The loop is named
+ * 'do', which can't clash with a variable - it is a keyword.
+ *
+ * @return: AST for the loop.
+ */
+std::unique_ptr<Node>
+Parser::_do()
+{
+	Token name = scanner.previous;
+	name.type = token_type::SYMBOL;
+	name.symbol = intern(name.string);
+
+	auto function = std::make_unique<Lambda>(name);
+	Program values;
+	Program steps;
+	bindings(*function, values, &steps);
+
+	auto branch = std::make_unique<If>(name);
+	consume(token_type::LPAREN, "Expected '(' before loop test");
+	branch->predicate = expression();
+	auto result = std::make_unique<Sequence>(name);
+	while (scanner.current.type != token_type::RPAREN && scanner.current.type != token_type::END) {
+		result->body.push_back(expression());
+	}
+	consume(token_type::RPAREN, "Expected ')' after loop result");
+
+	auto iteration = std::make_unique<Sequence>(name);
+	while (scanner.current.type != token_type::RPAREN && scanner.current.type != token_type::END) {
+		iteration->body.push_back(expression());
+	}
+	auto next = std::make_unique<Call>(name, std::make_unique<Symbol>(name));
+	next->arguments = std::move(steps);
+	iteration->body.push_back(std::move(next));
+
+	branch->consequent = std::move(result);
+	branch->alternative = std::move(iteration);
+	function->body.push_back(std::move(branch));
+	return loop(name, std::move(function), std::move(values));
+}
+
+/**
+ * Parse the bindings of a let or do loop - a list of variables, each with its
+ * initial value and (do loops only) optionally a step expression.
+ *
+ * @param function: function the variables become parameters of.
+ * @param values: receives the initial values, in order.
+ * @param steps: receives the step expressions (nullptr if not allowed).
+ */
+void
+Parser::bindings(Lambda& function, Program& values, Program* steps)
+{
+	consume(token_type::LPAREN, "Expected '(' before bindings");
+	while (scanner.current.type == token_type::LPAREN) {
+		advance();
+		consume(token_type::SYMBOL, "Expect symbol.");
+		Token variable = scanner.previous;
+		parameter(function);
+		values.push_back(expression());
+		if (steps != nullptr) {
+			if (scanner.current.type == token_type::RPAREN) steps->push_back(std::make_unique<Symbol>(variable));
+			else steps->push_back(expression());
+		}
+		consume(token_type::RPAREN, "Expected ')' after binding");
+	}
+	consume(token_type::RPAREN, "Expected ')' after bindings");
+}
+
+/**
+ * Build a loop: bind the function to a name it can call itself by, then apply
+ * it to the initial values. The values are evaluated outside the function's
+ * scope, so this is ((lambda () (define name function) name) values...).
+ *
+ * @param name: name the function is bound to.
+ * @param function: body of the loop as a function of the loop variables.
+ * @param values: initial values of the loop variables.
+ * @return: AST for the loop.
+ */
+std::unique_ptr<Node>
+Parser::loop(Token name, std::unique_ptr<Lambda> function, Program values)
+{
+	auto scope = std::make_unique<Lambda>(name);
+	scope->body.push_back(std::make_unique<Assignment>(node_type::DEFINE, name, name.string,
+		std::move(function)));
+	scope->body.push_back(std::make_unique<Symbol>(name));
+
+	auto node = std::make_unique<Call>(name, std::make_unique<Call>(name, std::move(scope)));
+	node->arguments = std::move(values);
+	return node;
+}
+
+/**
+ * Parse a ternary if - predicate, consequent, and alternative.
+ *
+ * @return: AST for the if.
+ */
+std::unique_ptr<Node>
+Parser::_if()
+{
+	auto node = std::make_unique<If>(scanner.previous);
+	node->predicate = expression();
+	node->consequent = expression();
+	node->alternative = expression();
+	return node;
+}
+
+/**
+ * Parse a logical operator - NOT takes one operand, AND and OR take two.
+ *
+ * @param type: AND, OR, or NOT.
+ * @return: AST for the operator.
+ */
+std::unique_ptr<Node>
+Parser::logical(node_type type)
+{
+	auto node = std::make_unique<Logical>(type, scanner.previous);
+	node->left = expression();
+	if (type != node_type::NOT) node->right = expression();
+	return node;
+}
+
+/**
+ * Parse the arguments of a call - the callee has just been parsed.
+ *
+ * @param token: first token of the call.
+ * @param callee: AST for the function called.
+ * @return: AST for the call.
+ */
+std::unique_ptr<Node>
+Parser::call(Token token, std::unique_ptr<Node> callee)
+{
+	auto node = std::make_unique<Call>(token, std::move(callee));
+	while (scanner.current.type != token_type::RPAREN) {
+		// TODO: consider role of thunk evaluation here.
+		if (scanner.current.type == token_type::END) {  // EOF reached early
+			error("Expected closing ')'", scanner.current);
+			break;
+		}
+		node->arguments.push_back(expression());
+	}
+	return node;
+}
@@ -0,0 +1,51 @@
+#ifndef LISP_PARSER_H
+#define LISP_PARSER_H
+
+#include "common.h"
+#include "scanner.h"
+#include "ast.h"
+
+/**
+ * Gets tokens from the scanner and builds the AST for a REPL line. Syntax
+ * errors are reported here; errors that depend on scope or on the state of
+ * the VM (e.g. variable redefinition) are reported by the Compiler.
+ *
+ * In lazy mode, the bodies of lambdas are skipped rather than parsed (see
+ * skip_body) - syntax errors in one are reported when it is first called.
+ */
+class Parser {
+private:
+	Scanner& scanner;
+
+	// Fewest tokens in the body of a lazy lambda - smaller bodies are cheap to
+	// compile, and a small global function may be inlined at -O2.
+	static constexpr size_t LAZY_TOKENS = 48;
+
+	bool lazy;
+	bool had_error = false;
+	bool panic_mode = false;
+	void advance();
+	void consume(token_type expected, std::string error_message);
+	void error(std::string error_message, Token token);
+
+	std::unique_ptr<Node> expression();
+	std::unique_ptr<Node> combination();
+	std::unique_ptr<Node> constant(Value value);
+	std::unique_ptr<Node> assignment(node_type type);
+	std::unique_ptr<Node> lambda(bool immediate = false);
+	void parameter(Lambda& node);
+	void skip_body(Lambda& node);
+	std::unique_ptr<Node> let();
+	std::unique_ptr<Node> _do();
+	void bindings(Lambda& function, Program& values, Program* steps);
+	std::unique_ptr<Node> loop(Token name, std::unique_ptr<Lambda> function, Program values);
+	std::unique_ptr<Node> _if();
+	std::unique_ptr<Node> logical(node_type type);
+	std::unique_ptr<Node> call(Token token, std::unique_ptr<Node> callee);
+public:
+	Parser(Scanner& scanner, bool lazy = false) : scanner{ scanner }, lazy{ lazy } {};
+	bool error() { return had_error; };
+	Program parse();
+};
+
+#endif
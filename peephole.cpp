@@ -0,0 +1,499 @@
+#include "peephole.h"
+#include "value.h"
+
+/**
+ * Pairs of instructions with a superinstruction. Chosen from the opcode pairs
+ * executed most often by the programs in bench/ (see PROFILE_OPCODE_PAIRS).
+ * Only the second instruction of a pair may call, so that returning resumes
+ * after the whole superinstruction. A jump in the first one skips the second.
+ */
+static const struct {
+	uint8_t first;
+	uint8_t second;
+	uint8_t fused;
+} superinstructions[] = {
+	{ opcode::GET_LOCAL, opcode::CONSTANT, opcode::GET_LOCAL_CONSTANT },
+	{ opcode::GET_LOCAL, opcode::GET_LOCAL, opcode::GET_LOCAL_LOCAL },
+	{ opcode::GET_GLOBAL, opcode::GET_LOCAL, opcode::GET_GLOBAL_LOCAL },
+	{ opcode::POP, opcode::GET_LOCAL, opcode::POP_GET_LOCAL },
+	{ opcode::POP, opcode::GET_GLOBAL, opcode::POP_GET_GLOBAL },
+	{ opcode::JUMP_IF_FALSE, opcode::POP, opcode::JUMP_IF_FALSE_POP },
+};
+
+/**
+ * Apply the rewrite rules until none match, then write the result back to
+ * the chunk. Jump targets are found once per sweep - within one, rewrites mark
+ * the instructions they make jump targets, and old targets stay marked.
+ */
+void
+PeepholeOptimizer::optimize()
+{
+	decode();
+
+	for (bool changed = true; changed;) {
+		changed = false;
+		find_targets();
+		for (size_t i = 0; i < code.size(); i++) {
+			if (code[i].removed) continue;
+			if (thread(i) || fuse_not(i) || cancel_pop(i)) changed = true;
+		}
+	}
+
+	encode();
+}
+
+/**
+ * Remove the instructions that can't be reached from the start of the chunk,
+ * following jumps and falling through from everything that doesn't always jump
+ * or return.
+ *
+ * @return: number of bytes removed.
+ */
+size_t
+PeepholeOptimizer::eliminate()
+{
+	decode();
+
+	std::vector<bool> reachable(code.size(), false);
+	std::vector<size_t> pending{ 0 };
+	while (!pending.empty()) {
+		size_t index = pending.back();
+		pending.pop_back();
+		if (index >= code.size() || reachable[index]) continue;
+		reachable[index] = true;
+
+		uint8_t op = code[index].op;
+		if (is_jump(op)) pending.push_back(code[index].target);
+		if (op != opcode::JUMP && op != opcode::LOOP && op != opcode::RETURN) pending.push_back(index + 1);
+	}
+
+	bool changed = false;
+	for (size_t i = 0; i < code.size(); i++) {
+		if (!reachable[i]) code[i].removed = changed = true;
+	}
+	if (!changed) return 0;
+
+	size_t length = chunk.instructions.size();
+	encode();
+	return length - chunk.instructions.size();
+}
+
+/**
+ * Replace pairs of instructions with their superinstruction, left to right.
+ * Code may jump to the first instruction of a pair but not the second.
+ */
+void
+PeepholeOptimizer::fuse()
+{
+	decode();
+	find_targets();
+
+	for (size_t first = 0; first + 1 < code.size(); first++) {
+		size_t second = first + 1;
+		if (code[first].removed || targeted[second]) continue;
+
+		if (code[first].wide || code[second].wide) continue;
+		for (auto& pair : superinstructions) {
+			if (code[first].op != pair.first || code[second].op != pair.second) continue;
+			code[first].op = pair.fused;
+			code[first].fused = second;
+			code[second].removed = true;
+			break;
+		}
+	}
+
+	encode();
+}
+
+/**
+ * @param value: constant to test.
+ * @return: is the constant an integer that fits in a signed byte? Negative
+ *          zero is not, as it would come back positive.
+ */
+static bool
+small_int(Value value)
+{
+	if (!value.match_type(value_type::NUMBER)) return false;
+	double number = value.as_number();
+	if (!(number >= INT8_MIN && number <= INT8_MAX)) return false;
+	if (number != static_cast<int>(number)) return false;
+	return number != 0 || !std::signbit(number);
+}
+
+/**
+ * Rewrite loads into their compact forms: the first few locals have their
+ * own opcodes, small integer constants are immediate and other indexes below
+ * 256 take one byte. Operands are little-endian, so a one-byte operand is
+ * already in place.
+ */
+void
+PeepholeOptimizer::compact()
+{
+	decode();
+
+	for (auto& instruction : code) {
+		if (instruction.wide) continue;
+		size_t operand_offset = instruction.offset + 1;
+		size_t operand = 0;
+		if (instruction.length == 3) {
+			operand = chunk.instructions[operand_offset + 1] * 256 + chunk.instructions[operand_offset];
+		}
+
+		switch (instruction.op) {
+			case opcode::GET_LOCAL:
+				if (operand <= 3) {
+					instruction.op = static_cast<uint8_t>(opcode::GET_LOCAL_0 + operand);
+					instruction.length = 1;
+				}
+				else if (operand <= UINT8_MAX) {
+					instruction.op = opcode::GET_LOCAL_SHORT;
+					instruction.length = 2;
+				}
+				break;
+			case opcode::GET_GLOBAL:
+				if (operand <= UINT8_MAX) {
+					instruction.op = opcode::GET_GLOBAL_SHORT;
+					instruction.length = 2;
+				}
+				break;
+			case opcode::CONSTANT:
+				if (small_int(chunk.constants[operand])) {
+					auto immediate = static_cast<int8_t>(chunk.constants[operand].as_number());
+					chunk.instructions[operand_offset] = static_cast<uint8_t>(immediate);
+					instruction.op = opcode::SMALL_INT;
+					instruction.length = 2;
+				}
+				else if (operand <= UINT8_MAX) {
+					instruction.op = opcode::CONSTANT_SHORT;
+					instruction.length = 2;
+				}
+				break;
+		}
+	}
+
+	encode();
+}
+
+/**
+ * Split the bytecode into instructions and resolve jump offsets to the
+ * index of the instruction jumped to.
+ */
+void
+PeepholeOptimizer::decode()
+{
+	std::unordered_map<size_t, size_t> indexes;  // Offset to index.
+
+	for (size_t offset = 0; offset < chunk.instructions.size();) {
+		indexes[offset] = code.size();
+		size_t length = chunk.instruction_length(offset);
+		code.push_back(Instruction{ .offset = offset, .length = length,
+			.op = chunk.instruction_op(offset), .wide = chunk.instructions[offset] == opcode::WIDE });
+		offset += length;
+	}
+	indexes[chunk.instructions.size()] = code.size();
+
+	for (auto& instruction : code) {
+		if (!is_jump(instruction.op)) continue;
+		size_t jump = chunk.operand(instruction.offset);
+		size_t next_offset = instruction.offset + instruction.length;
+		instruction.target = indexes[instruction.op == opcode::LOOP ? next_offset - jump : next_offset + jump];
+	}
+}
+
+/**
+ * Write the remaining instructions back to the chunk. A removed instruction's
+ * line marker moves to the next instruction that is kept.
+ */
+void
+PeepholeOptimizer::encode()
+{
+	std::vector<size_t> offsets = layout();
+	std::vector<uint8_t> instructions;
+	std::vector<bool> newlines;
+	instructions.reserve(offsets.back());
+	newlines.reserve(offsets.back());
+	bool newline = false;
+
+	for (size_t i = 0; i < code.size(); i++) {
+		auto& instruction = code[i];
+		newline = newline || chunk.newlines[instruction.offset];
+		if (instruction.removed) continue;
+
+		if (instruction.op == opcode::RETURN) {  // Possibly a former jump.
+			instructions.push_back(instruction.op);
+			newlines.push_back(newline);
+			newline = false;
+			continue;
+		}
+		if (instruction.wide) {
+			instructions.push_back(opcode::WIDE);
+			newlines.push_back(newline);
+			newline = false;
+		}
+		instructions.push_back(instruction.op);
+		newlines.push_back(newline);
+		newline = false;
+
+		if (is_jump(instruction.op)) {
+			// Offsets are written afresh - the jump may have become WIDE.
+			size_t next_offset = offsets[i] + encoded_length(i);
+			size_t jump = instruction.op == opcode::LOOP ?
+				next_offset - offsets[instruction.target] : offsets[instruction.target] - next_offset;
+			for (size_t byte = 0; byte < (instruction.wide ? 4 : 2); byte++) {
+				instructions.push_back(static_cast<uint8_t>(jump >> (8 * byte)));
+				newlines.push_back(false);
+			}
+			continue;
+		}
+
+		size_t operands = instruction.offset + (instruction.wide ? 2 : 1);
+		for (size_t byte = operands; byte < instruction.offset + instruction.length; byte++) {
+			instructions.push_back(chunk.instructions[byte]);
+			newlines.push_back(chunk.newlines[byte]);
+		}
+		if (instruction.fused) {
+			auto& second = code[instruction.fused];
+			for (size_t byte = 1; byte < second.length; byte++) {
+				instructions.push_back(chunk.instructions[second.offset + byte]);
+				newlines.push_back(chunk.newlines[second.offset + byte]);
+			}
+		}
+	}
+
+	chunk.instructions = std::move(instructions);
+	chunk.newlines = std::move(newlines);
+}
+
+/**
+ * Work out the new offset of each instruction - removed ones take the next
+ * kept offset. Jumps start out narrow, and one too far for a uint16 offset is
+ * made WIDE, which moves later code, so this repeats until every jump fits.
+ *
+ * @return: offset of each instruction, then the total length.
+ */
+std::vector<size_t>
+PeepholeOptimizer::layout()
+{
+	for (auto& jump : code) {
+		if (jump.wide && is_jump(jump.op)) {
+			jump.wide = false;
+			jump.length -= 3;
+		}
+	}
+
+	std::vector<size_t> offsets(code.size() + 1);
+	for (bool widened = true; widened;) {
+		size_t offset = 0;
+		for (size_t i = 0; i < code.size(); i++) {
+			offsets[i] = offset;
+			offset += encoded_length(i);
+		}
+		offsets[code.size()] = offset;
+
+		widened = false;
+		for (size_t i = 0; i < code.size(); i++) {
+			auto& jump = code[i];
+			if (jump.removed || jump.wide || !is_jump(jump.op)) continue;
+			size_t next_offset = offsets[i] + encoded_length(i);
+			size_t target = offsets[jump.target];
+			size_t distance = jump.op == opcode::LOOP ? next_offset - target : target - next_offset;
+			if (distance > UINT16_MAX) {
+				jump.wide = true;
+				jump.length += 3;
+				widened = true;
+			}
+		}
+	}
+	return offsets;
+}
+
+/**
+ * @param index: index of an instruction.
+ * @return: number of bytes the instruction takes up once encoded.
+ */
+size_t
+PeepholeOptimizer::encoded_length(size_t index)
+{
+	auto& instruction = code[index];
+	if (instruction.removed) return 0;
+	if (instruction.op == opcode::RETURN) return 1;  // Possibly a former jump.
+	if (instruction.fused) return instruction.length + code[instruction.fused].length - 1;
+	return instruction.length;
+}
+
+/**
+ * Thread a forward jump through the jumps it lands on, and simplify it if it
+ * then lands on a RETURN or the next instruction. A conditional jump keeps its
+ * value on the stack, so it can follow an unconditional jump or a conditional
+ * jump on the same condition.
+ *
+ * @param index: instruction to rewrite.
+ * @return: was the instruction changed?
+ */
+bool
+PeepholeOptimizer::thread(size_t index)
+{
+	auto& jump = code[index];
+	if (!is_jump(jump.op) || jump.op == opcode::LOOP) return false;
+
+	size_t target = resolve(jump.target);
+	while (target < code.size() &&
+		(code[target].op == opcode::JUMP || code[target].op == jump.op)) {
+		target = resolve(code[target].target);
+	}
+
+	bool changed = target != jump.target;
+	jump.target = target;
+	targeted[target] = true;
+
+	if (target == next(index)) {
+		remove(index);
+		return true;
+	}
+	if (jump.op == opcode::JUMP && op_at(target, opcode::RETURN)) {
+		jump.op = opcode::RETURN;
+		return true;
+	}
+	return changed;
+}
+
+/**
+ * Remove a NOT before a conditional jump whose value is popped straight away
+ * on both paths - only the jump condition depends on the value.
+ *
+ * @param index: instruction to rewrite.
+ * @return: was the instruction changed?
+ */
+bool
+PeepholeOptimizer::fuse_not(size_t index)
+{
+	auto& jump = code[index];
+	if (jump.op != opcode::JUMP_IF_FALSE && jump.op != opcode::JUMP_IF_TRUE) return false;
+	if (targeted[index]) return false;
+
+	size_t negation = previous(index);
+	if (!op_at(negation, opcode::NOT)) return false;
+	if (!op_at(next(index), opcode::POP) || !op_at(resolve(jump.target), opcode::POP)) return false;
+
+	remove(negation);
+	jump.op = jump.op == opcode::JUMP_IF_FALSE ? opcode::JUMP_IF_TRUE : opcode::JUMP_IF_FALSE;
+	return true;
+}
+
+/**
+ * Remove a value that is pushed and then popped without being used, or a NOT
+ * whose result is popped without being used.
+ *
+ * @param index: instruction to rewrite.
+ * @return: was the instruction changed?
+ */
+bool
+PeepholeOptimizer::cancel_pop(size_t index)
+{
+	size_t pop = next(index);
+	if (!op_at(pop, opcode::POP)) return false;
+
+	switch (code[index].op) {
+		case opcode::NOT:
+			remove(index);
+			return true;
+		case opcode::CONSTANT:
+		case opcode::TRUE:
+		case opcode::FALSE:
+		case opcode::NIL:
+		case opcode::GET_LOCAL:
+		case opcode::GET_UPVALUE:
+		case opcode::GET_CAPTURED:
+			// Code jumping to the POP has its own value to remove.
+			if (targeted[pop]) return false;
+			remove(index);
+			remove(pop);
+			return true;
+		default:
+			return false;
+	}
+}
+
+/**
+ * Record which instructions are jumped to.
+ */
+void
+PeepholeOptimizer::find_targets()
+{
+	targeted.assign(code.size() + 1, false);
+	for (auto& instruction : code) {
+		if (!instruction.removed && is_jump(instruction.op)) {
+			targeted[resolve(instruction.target)] = true;
+		}
+	}
+}
+
+/**
+ * Remove an instruction during a sweep of the rewrite rules. Jumps to it now
+ * land on the next instruction kept.
+ *
+ * @param index: instruction to remove.
+ */
+void
+PeepholeOptimizer::remove(size_t index)
+{
+	code[index].removed = true;
+	if (targeted[index]) targeted[next(index)] = true;
+}
+
+/**
+ * @param index: index of an instruction, possibly removed.
+ * @return: index of the first instruction kept at or after it.
+ */
+size_t
+PeepholeOptimizer::resolve(size_t index)
+{
+	while (index < code.size() && code[index].removed) index++;
+	return index;
+}
+
+/**
+ * @param index: index of an instruction.
+ * @return: index of the next instruction kept.
+ */
+size_t
+PeepholeOptimizer::next(size_t index)
+{
+	return resolve(index + 1);
+}
+
+/**
+ * @param index: index of an instruction.
+ * @return: index of the previous instruction kept, or the number of
+ *          instructions if there is none.
+ */
+size_t
+PeepholeOptimizer::previous(size_t index)
+{
+	while (index > 0) {
+		if (!code[--index].removed) return index;
+	}
+	return code.size();
+}
+
+/**
+ * @param op: opcode.
+ * @return: does the opcode take a jump offset? Only LOOP jumps backwards.
+ */
+bool
+PeepholeOptimizer::is_jump(uint8_t op)
+{
+	return op == opcode::JUMP || op == opcode::JUMP_IF_FALSE || op == opcode::JUMP_IF_TRUE ||
+		op == opcode::JUMP_IF_FALSE_POP || op == opcode::LOOP;
+}
+
+/**
+ * @param index: index of an instruction, or the number of instructions.
+ * @param op: opcode to test for.
+ * @return: is there an instruction with this opcode at the index?
+ */
+bool
+PeepholeOptimizer::op_at(size_t index, uint8_t op)
+{
+	return index < code.size() && code[index].op == op;
+}
@@ -0,0 +1,67 @@
+#ifndef LISP_PEEPHOLE_H
+#define LISP_PEEPHOLE_H
+
+#include "common.h"
+#include "bytecode.h"
+
+/**
+ * Bytecode pass that rewrites short instruction sequences in a finished chunk:
+ *
+ * - jumps to jumps are threaded to the final target, and a jump to a RETURN
+ *   becomes a RETURN;
+ * - jumps to the next instruction are removed;
+ * - NOTs before a conditional jump whose value is discarded on both paths are
+ *   removed, flipping the jump (JUMP_IF_FALSE / JUMP_IF_TRUE) for each one;
+ * - a value that is pushed only to be popped is never pushed, and a NOT right
+ *   before a POP is removed.
+ *
+ * Rules are applied until none match, then the chunk is re-encoded with jump
+ * offsets and line information fixed up. A jump whose offset no longer fits
+ * in a uint16 gets a WIDE prefix.
+ *
+ * Instructions that can't be reached are removed by a separate pass, once the
+ * rules above have run - e.g. a jump after a loop becomes a RETURN first.
+ *
+ * Separately, common pairs of instructions can be fused into superinstructions
+ * - this is done after the rules above, as they don't recognize them. Last of
+ * all, instructions can be compacted into forms with shorter operands.
+ */
+class PeepholeOptimizer {
+private:
+	struct Instruction {
+		size_t offset;  // In the original bytecode.
+		size_t length;
+		uint8_t op;  // After any WIDE prefix.
+		bool wide = false;  // Are the operands uint32?
+		size_t target = 0;  // Index of instruction jumped to - jumps only.
+		size_t fused = 0;  // Index of instruction merged into this one, if any.
+		bool removed = false;
+	};
+
+	Chunk& chunk;
+	std::vector<Instruction> code;
+	std::vector<bool> targeted;  // Is the instruction at this index jumped to? See optimize.
+
+	void decode();
+	void encode();
+	std::vector<size_t> layout();
+	size_t encoded_length(size_t index);
+	bool thread(size_t index);
+	bool fuse_not(size_t index);
+	bool cancel_pop(size_t index);
+	void find_targets();
+	void remove(size_t index);
+	size_t resolve(size_t index);
+	size_t next(size_t index);
+	size_t previous(size_t index);
+	bool is_jump(uint8_t op);
+	bool op_at(size_t index, uint8_t op);
+public:
+	void optimize();
+	size_t eliminate();
+	void fuse();
+	void compact();
+	PeepholeOptimizer(Chunk& chunk) : chunk{ chunk } {}
+};
+
+#endif
@@ -1,5 +1,20 @@
 #include "scanner.h"
 
+/**
+ * Intern the name of a symbol. Equal names get the same id for the lifetime of
+ * the program, so the compiler can resolve variables by id rather than by
+ * comparing strings.
+ *
+ * @param name: name of the symbol.
+ * @return: id of the name, never 0.
+ */
+size_t
+intern(const std::string& name)
+{
+	static std::unordered_map<std::string, size_t> symbols;
+	return symbols.try_emplace(name, symbols.size() + 1).first->second;
+}
+
 /**
  * Scan source and return the next token, or a token of type token_type::END if
  * the entire source has been scanned.
@@ -24,6 +39,9 @@ Scanner::scan()
 		case ')':
 			return make_token(token_type::RPAREN);
 		case '=':
+		case '<':
+		case '>':
+		case '*':
 			return make_token(token_type::SYMBOL);
 		case '+':
 		case '-':
@@ -90,13 +108,29 @@ Scanner::classify_alphanumeric()
 		case 'a':
 			return check_keyword(1, "nd", token_type::AND);
 		case 'd':
-			return check_keyword(1, "efine", token_type::DEFINE);
+			if (end > start + 1) {
+				switch (source[start + 1]) {
+					case 'e':
+						return check_keyword(2, "fine", token_type::DEFINE);
+					case 'o':
+						return check_keyword(2, "", token_type::DO);
+				}
+			}
+			break;
 		case 'f':
 			return check_keyword(1, "alse", token_type::FALSE);
 		case 'i':
 			return check_keyword(1, "f", token_type::IF);
 		case 'l':
-			return check_keyword(1, "ambda", token_type::LAMBDA);
+			if (end > start + 1) {
+				switch (source[start + 1]) {
+					case 'a':
+						return check_keyword(2, "mbda", token_type::LAMBDA);
+					case 'e':
+						return check_keyword(2, "t", token_type::LET);
+				}
+			}
+			break;
 		case 'n':
 			if (end > start + 1) {
 				switch (source[start + 1]) {
@@ -157,7 +191,8 @@ Scanner::make_token(const token_type type)
 		return make_error("unexpected characters after " + token_string + ".");
 	}
 
-	return Token{.type = type, .string = token_string, .line = line};
+	size_t symbol = type == token_type::SYMBOL ? intern(token_string) : 0;
+	return Token{.type = type, .string = token_string, .line = line, .symbol = symbol};
 }
 
 /**
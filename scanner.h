@@ -8,14 +8,14 @@
 /**
  * Most tokens (including most built-in functions) are symbols and will be
  * resolved to values. Booleans, logical operators, numbers, and special forms
- * like ternary if and lambda declaration are their own type of token.
+ * like ternary if, lambda declaration, and loops are their own type of token.
  */
 enum class token_type
 {
 	BEGIN, END, ERROR,
 	LPAREN, RPAREN,
 	NOT, AND, OR, TRUE, FALSE,
-	IF, LAMBDA,
+	IF, LAMBDA, LET, DO,
 	NUMBER, NIL, SYMBOL,
 	DEFINE, SET
 };
@@ -29,8 +29,11 @@ struct Token
 	token_type type;	 // Information needed to compile token.
 	std::string string;  // String representation of token.
 	size_t line;		 // Line in source code token appears.
+	size_t symbol = 0;	 // Interned name of a SYMBOL token (see intern).
 };
 
+size_t intern(const std::string& name);
+
 /** 
  * Converts source file / input line to tokens. Provides one token at a time.
  */
@@ -51,6 +54,8 @@ private:
 public:
 	Scanner(std::string& source) :source{ source } {};
 	void advance();
+	size_t offset() { return start; }  // Where the current token starts.
+	std::string text(size_t from) { return source.substr(from, start - from); }
 	Token current, previous;
 };
 
@@ -0,0 +1,14 @@
+((lambda (x) (+ x 1)) 5)
+((lambda () 7))
+((lambda (a b) (* a b)) 3 4)
+(define mk (lambda (n) (lambda (m) (+ n m))))
+((mk 10) 5)
+((lambda (x) x) 1 2)
+(define f (lambda (y) ((lambda (x) (+ x y)) 2)))
+(f 40)
+(define g 0)
+((lambda (y) (set g (lambda () y)) (set y 9) 0) 1)
+(cons 1 2)
+(g)
+(() 1)
+((if true mk mk) 1)
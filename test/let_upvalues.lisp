@@ -0,0 +1,8 @@
+(define g 0)
+(let ((y 1)) (set g (lambda () y)) (set y 9) 0)
+(cons 1 2)
+(g)
+(define id (lambda (v) v))
+(let ((z 2)) (set g (lambda () z)) (set z 7) (id 0))
+(cons 3 4)
+(g)
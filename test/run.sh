@@ -0,0 +1,49 @@
+#!/bin/sh
+# Build the interpreter in each configuration and check each program's output
+# against the .expected file beside it, at each optimization level.
+#
+# Usage: test/run.sh [program.lisp ...]
+#
+# CXX and CXXFLAGS can be overridden, as for bench/run.sh.
+
+cd "$(dirname "$0")/.." || exit 1
+
+CXX=${CXX:-g++}
+CXXFLAGS=${CXXFLAGS:-"-std=c++20 -O2"}
+BUILD=${BUILD:-$(mktemp -d)}
+
+# name:flags - flags are added to CXXFLAGS for that configuration.
+CONFIGS="
+switch:-DDISABLE_COMPUTED_GOTO
+threaded:
+nanbox:-DNAN_BOXING
+"
+OPTIONS="-O0 -O1 -O2 --lazy"
+
+if [ $# -eq 0 ]; then
+	set -- test/*.lisp
+fi
+
+for config in $CONFIGS; do
+	name=${config%%:*}
+	flags=$(echo "${config#*:}" | tr ',' ' ')
+	echo "building $name"
+	$CXX $CXXFLAGS -DNDEBUG $flags -o "$BUILD/$name" *.cpp || exit 1
+done
+
+failed=0
+for program in "$@"; do
+	for config in $CONFIGS; do
+		name=${config%%:*}
+		for option in $OPTIONS; do
+			if ! "$BUILD/$name" $option < "$program" 2>/dev/null |
+				diff -q - "${program%.lisp}.expected" > /dev/null; then
+				echo "FAIL $(basename "$program") ($name $option)"
+				failed=1
+			fi
+		done
+	done
+done
+
+[ $failed -eq 0 ] && echo "all passed"
+exit $failed
@@ -11,29 +11,28 @@ std::string
 Value::print()
 {
 	{
-		switch (type) {
+		switch (type()) {
 			case value_type::NUMBER:
-				return std::to_string(as.number);
+				return std::to_string(as_number());
 
 			case value_type::BOOL:
-				return std::to_string(as.boolean);
+				return std::to_string(as_boolean());
 
 			case value_type::NIL:
 				return "nil";
 
 			case value_type::DATA:
-				switch (as.data->type) {
+				switch (as_data()->type) {
 					// TODO: data structures with cycles
 					case data_type::PAIR: {
-						auto pair = std::any_cast<Pair>(as.data->data);
-						auto car = pair.car.print();
-						auto cdr = pair.cdr.print();
+						auto pair = as_data()->cast<Pair>();
+						auto car = pair->car.print();
+						auto cdr = pair->cdr.print();
 						return "(" + car + " . " + cdr + ")";
 					}
 
 					case data_type::FUNCTION: {
-						using func_t = std::shared_ptr<Function>;
-						auto function = as.data->cast<func_t>();
+						auto function = as_data()->cast<Function>();
 
 						if (function->anonymous()) {
 							auto line = function->bytecode.base_line;
@@ -46,10 +45,7 @@ Value::print()
 					}
 			
 					case data_type::CLOSURE: {
-						using clos_t = std::shared_ptr<Closure>;
-						using func_t = std::shared_ptr<Function>;
-						auto closure = as.data->cast<clos_t>();
-						auto function = closure->function->cast<func_t>();
+						auto function = as_data()->cast<Closure>()->function;
 
 						if (function->anonymous()) {
 							auto line = function->bytecode.base_line;
@@ -62,8 +58,7 @@ Value::print()
 					}
 				
 					case data_type::BUILTIN: {
-						using bfunc_t = std::shared_ptr<BuiltinFunction>;
-						auto builtin = as.data->cast<bfunc_t>();
+						auto builtin = as_data()->cast<BuiltinFunction>();
 
 						return "Built-in function " + builtin->name();
 					}
@@ -78,18 +73,6 @@ Value::print()
 	}
 }
 
-/**
- * Convenience function to check the data type of a value.
- * 
- * @param match: data_type to check for.
- * @return: is the Value of data_type 'match'?
- */
-bool
-Value::match_data_type(data_type match)
-{
-	return type == value_type::DATA && as.data->type == match;
-}
-
 /**
  * Convenience function for garbage collector.
  * 
@@ -100,20 +83,17 @@ Data::size()
 {
 	switch (type) {
 		case data_type::PAIR:
-			return sizeof(Pair) + sizeof(Data);
+			return sizeof(Pair);
 		case data_type::FUNCTION:
-			using func_pt = std::shared_ptr<Function>;
-			return cast<func_pt>()->size() + sizeof(func_pt) + sizeof(Data);
+			return cast<Function>()->size();
 		case data_type::CLOSURE:
-			using clos_pt = std::shared_ptr<Closure>;
-			return cast<clos_pt>()->size() + sizeof(clos_pt) + sizeof(Data);
+			return cast<Closure>()->size();
 		case data_type::STRING:
-			return cast<std::string&>().size() + sizeof(Data);
+			return sizeof(String) + cast<String>()->string.capacity();
 		case data_type::UPVALUE:
-			return sizeof(RuntimeUpvalue) + sizeof(Data);
+			return sizeof(RuntimeUpvalue);
 		case data_type::BUILTIN:
-			using bfunc_t = std::shared_ptr<BuiltinFunction>;
-			return cast<bfunc_t>()->size() + sizeof(Data);
+			return cast<BuiltinFunction>()->size();
 		default:
 			return sizeof(Data);
 	}
@@ -27,91 +27,176 @@ struct Closure;
 struct BuiltinFunction;
 struct RuntimeUpvalue;
 
+#ifdef NAN_BOXING
+/**
+ * Representing value as a NaN-boxed 64-bit word. Any bit pattern that isn't a
+ * quiet NaN is a number. Quiet NaNs carry either a singleton tag in the low
+ * bits, or (with the sign bit set) a pointer to Data in the low 48 bits.
+ */
+struct Value
+{
+private:
+	static constexpr uint64_t SIGN_BIT = 0x8000000000000000;
+	static constexpr uint64_t QNAN = 0x7ffc000000000000;
+	static constexpr uint64_t TAG_NIL = 1;
+	static constexpr uint64_t TAG_FALSE = 2;
+	static constexpr uint64_t TAG_TRUE = 3;
+	static constexpr uint64_t TAG_UNINITIALIZED = 4;
+	static constexpr uint64_t TAG_UNDEFINED = 5;
+	uint64_t bits;
+public:
+	Value(bool val) : bits{ QNAN | (val ? TAG_TRUE : TAG_FALSE) } {}
+	Value(double val) : bits{ std::bit_cast<uint64_t>(val) } {}
+	Value(Data* val) : bits{ SIGN_BIT | QNAN | reinterpret_cast<uintptr_t>(val) } {}
+	Value(value_type singleton_type) {
+		if (singleton_type == value_type::NIL) bits = QNAN | TAG_NIL;
+		else if (singleton_type == value_type::UNINITIALIZED)
+			bits = QNAN | TAG_UNINITIALIZED;
+		else bits = QNAN | TAG_UNDEFINED;
+	}
+	value_type type() const {
+		if ((bits & QNAN) != QNAN) return value_type::NUMBER;
+		if (bits & SIGN_BIT) return value_type::DATA;
+		switch (bits & ~QNAN) {
+			case TAG_NIL: return value_type::NIL;
+			case TAG_FALSE:
+			case TAG_TRUE: return value_type::BOOL;
+			case TAG_UNINITIALIZED: return value_type::UNINITIALIZED;
+			default: return value_type::UNDEFINED;
+		}
+	}
+	bool match_type(value_type match) const {
+		switch (match) {
+			case value_type::NUMBER: return (bits & QNAN) != QNAN;
+			case value_type::DATA: return (bits & (SIGN_BIT | QNAN)) == (SIGN_BIT | QNAN);
+			case value_type::BOOL: return (bits | 1) == (QNAN | TAG_TRUE);
+			default: return type() == match;
+		}
+	}
+	double as_number() const { return std::bit_cast<double>(bits); }
+	bool as_boolean() const { return bits == (QNAN | TAG_TRUE); }
+	Data* as_data() const {
+		return reinterpret_cast<Data*>(bits & ~(SIGN_BIT | QNAN));
+	}
+	std::string print();
+	bool match_data_type(data_type match) const;
+};
+
+static_assert(sizeof(Value) == sizeof(uint64_t));
+#else
 /**
  * Representing value as tagged union (as in Crafting Interpreters) to
  * minimize memory footprint and gain practice using tagged unions.
  */
 struct Value
 {
-	value_type type;
+private:
+	value_type tag;
 	union {
 		bool boolean;
 		double number;
 		Data* data;
 		value_type type;
 	} as;
-	Value(bool val) : type{ value_type::BOOL }, as{ .boolean=val } {}
-	Value(double val) : type{ value_type::NUMBER }, as{ .number=val } {}
-	Value(Data* val) : type{ value_type::DATA }, as{ .data=val } {}
+public:
+	Value(bool val) : tag{ value_type::BOOL }, as{ .boolean=val } {}
+	Value(double val) : tag{ value_type::NUMBER }, as{ .number=val } {}
+	Value(Data* val) : tag{ value_type::DATA }, as{ .data=val } {}
 	// TODO: consider error type per type systems and programming languages
 	// TODO: verify constructor can be simplified and do so if possible.
 	Value(value_type singleton_type) {
 		if (singleton_type == value_type::NIL ||
 			singleton_type == value_type::UNINITIALIZED) {
-			type = singleton_type;
+			tag = singleton_type;
 			as = { .type = singleton_type };
 		}
 		else {
-			type = value_type::UNDEFINED;
+			tag = value_type::UNDEFINED;
 			as = { .type = value_type::UNDEFINED };
 		}
 	}
+	value_type type() const { return tag; }
+	bool match_type(value_type match) const { return tag == match; }
+	double as_number() const { return as.number; }
+	bool as_boolean() const { return as.boolean; }
+	Data* as_data() const { return as.data; }
 	std::string print();
-	bool match_data_type(data_type match);
+	bool match_data_type(data_type match) const;
 };
+#endif
+
+/**
+ * Header shared by every object stored in memory - can be pointed to by Value
+ * and cleaned up by garbage collection as needed. Each object type derives
+ * from Data and is allocated (header and payload) as a single block.
+ */
+struct Data
+{
+	data_type type;
+	bool reachable = false;  // Used by GC.
+	Data* next = nullptr;    // Used by Memory to track all allocated objects.
+
+	/**
+	 * Convenience function for accessing the object containing this header.
+	 * Intended to be used with a LBYL strategy in conjunction with data_type.
+	 * 
+	 * @return: this object, cast to T
+	 */
+	template <typename T>
+	T* cast() { return static_cast<T*>(this); }
+	size_t size();
+	std::string print();
+protected:
+	Data(data_type type) : type{ type } {}
+};
+
+/**
+ * Convenience function to check the data type of a value.
+ * 
+ * @param match: data_type to check for.
+ * @return: is the Value of data_type 'match'?
+ */
+inline bool
+Value::match_data_type(data_type match) const
+{
+	return match_type(value_type::DATA) && as_data()->type == match;
+}
 
 /**
  * Contains information needed to track down the Value associated with a local.
- * Will either have the stack index or a stored copy of the Value.
+ * While open, 'location' points to the local's stack slot. Once the local's
+ * frame returns, the Value is moved into 'closed' and 'location' points there.
  */
-struct RuntimeUpvalue
+struct RuntimeUpvalue : Data
 {
-	size_t index;
-	Value data = Value(value_type::UNINITIALIZED);
+	Value* location;
+	Value closed = Value(value_type::UNINITIALIZED);
+	RuntimeUpvalue* next_open = nullptr;  // Used by VM to track open upvalues.
 
 	/**
-	* @param index: current stack index of local.
+	* @param location: current stack slot of local.
 	*/
-	RuntimeUpvalue(size_t index) : index{ index } {}
+	RuntimeUpvalue(Value* location) : Data(data_type::UPVALUE), location{ location } {}
 };
 
 // TODO: procedure for printing cyclical structures made of these.
 /**
  * A classic Lisp car/cdr pair that can be used to construct data structures.
  */
-struct Pair {
+struct Pair : Data
+{
 	Value car;
 	Value cdr;
-	Pair(Value car, Value cdr) : car{ car }, cdr{ cdr } {};
+	Pair(Value car, Value cdr) : Data(data_type::PAIR), car{ car }, cdr{ cdr } {};
 };
 
 /**
- * Data stored in memory - can be pointed to by Value and cleaned up by
- * garbage collection as needed. 
+ * A string stored in memory.
  */
-struct Data
+struct String : Data
 {
-	data_type type;
-	std::any data;
-	bool reachable = false;  // Used by GC.
-
-	Data(Pair pair) : type{ data_type::PAIR }, data{ pair } {}
-	Data(std::string string) : type{ data_type::STRING }, data{ string } {}
-	Data(std::shared_ptr<Function> function) : type{ data_type::FUNCTION }, data{ function } {}
-	Data(std::shared_ptr<Closure> closure) : type{ data_type::CLOSURE }, data{ closure } {}
-	Data(std::shared_ptr<BuiltinFunction> builtin) : type{ data_type::BUILTIN }, data{ builtin } {}
-	Data(std::shared_ptr<RuntimeUpvalue> upvalue) : type{ data_type::UPVALUE }, data{ upvalue } {}
-
-	/**
-	 * Convenience function for casting 'data'. Intended to be used with a LBYL
-	 * strategy in conjunction with data_type.
-	 * 
-	 * @return: 'data', cast to T
-	 */
-	template <typename T>
-	T cast() { return std::any_cast<T>(data); }
-	size_t size();
-	std::string print();
+	std::string string;
+	String(std::string string) : Data(data_type::STRING), string{ string } {};
 };
 
 // Also note - GC will need to care about this.
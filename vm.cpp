@@ -1,27 +1,61 @@
 
 #include "vm.h"
 #include "compiler.h"
+#include "parser.h"
 
 /**
  * Convenience function for defining a global builtin.
  * 
- * @param builtin: shared pointer to builtin to add.
+ * @param builtin: builtin to add, allocated in runtime memory.
  */
 void
-VirtualMachine::global_builtin(std::shared_ptr<BuiltinFunction> builtin)
+VirtualMachine::global_builtin(BuiltinFunction* builtin)
 {
-	globals[global(builtin->name())] = allocate(builtin);
+	globals[global(builtin->name())] = Value(builtin);
+}
+
+/**
+ * Convenience function for defining a global builtin that the compiler can
+ * replace with its own opcode when called with two arguments.
+ * 
+ * @param builtin: builtin to add, allocated in runtime memory.
+ * @param op: opcode implementing the builtin.
+ */
+void
+VirtualMachine::global_primitive(BuiltinFunction* builtin, uint8_t op)
+{
+	global_builtin(builtin);
+	primitives[op] = Primitive{ .global = global(builtin->name()), .builtin = builtin };
+	primitive_opcodes[builtin->name()] = op;
+	operator_globals = std::max(operator_globals, primitives[op].global + 1);
 }
 
 /**
  * Construct the VM - requires allocation of built-in functions.
  */
 VirtualMachine::VirtualMachine()
+	: stack(STACK_MAX, Value(value_type::NIL)), stack_top{ stack.data() }
 {
-	global_builtin(std::make_shared<BuiltinCons>(this));
-	global_builtin(std::make_shared<BuiltinAdd>());
-	global_builtin(std::make_shared<BuiltinSubtract>());
-	global_builtin(std::make_shared<BuiltinEqual>());
+	frames.reserve(RECURSION_MAX);
+	global_builtin(allocate<BuiltinCons>(this));
+	global_primitive(allocate<BuiltinAdd>(), opcode::ADD);
+	global_primitive(allocate<BuiltinSubtract>(), opcode::SUBTRACT);
+	global_primitive(allocate<BuiltinMultiply>(), opcode::MULTIPLY);
+	global_primitive(allocate<BuiltinEqual>(), opcode::EQUAL);
+	global_primitive(allocate<BuiltinLess>(), opcode::LESS);
+	global_primitive(allocate<BuiltinGreater>(), opcode::GREATER);
+}
+
+/**
+ * Convenience function that pushes a value onto the VM stack. Space is not
+ * checked here - see VirtualMachine::call.
+ * 
+ * @param value: Value to push.
+ */
+inline void
+VirtualMachine::stack_push(Value value)
+{
+	*stack_top++ = value;
 }
 
 /**
@@ -29,12 +63,10 @@ VirtualMachine::VirtualMachine()
  * 
  * @return: Value popped from the stack.
  */
-Value
+inline Value
 VirtualMachine::stack_pop()
 {
-	Value value = stack.back();
-	stack.pop_back();
-	return value;
+	return *--stack_top;
 }
 
 /**
@@ -43,10 +75,19 @@ VirtualMachine::stack_pop()
  * @param depth: offset from top of stack to examine. 0 is top of stack.
  * @return: stack value offset from top by depth.
  */
-Value
+inline Value
 VirtualMachine::stack_peek(size_t depth)
 {
-	return stack[stack.size() - depth - 1];
+	return stack_top[-1 - static_cast<ptrdiff_t>(depth)];
+}
+
+/**
+ * Convenience function that empties the VM stack.
+ */
+void
+VirtualMachine::stack_reset()
+{
+	stack_top = stack.data();
 }
 
 // TODO: better line handling
@@ -63,105 +104,125 @@ VirtualMachine::runtime_error(std::string message, size_t line)
 
 	for (size_t i = frames.size(); i > 0; i--) {
 		CallFrame& frame = frames[i - 1];
-		uint8_t* start = frame.closure->function_ptr()->bytecode.instructions.data();
+		uint8_t* start = frame.chunk->instructions.data();
 		size_t instruction = frame.ip - start - 1;
-		std::cerr << "in " << frame.closure->function_ptr()->name << '\n';  // TODO: anonymous function names
+		std::cerr << "in " << frame.function->name << '\n';  // TODO: anonymous function names
 	}
 
 	frames.clear();
-	stack.clear();  // TODO - clear func?
+	stack_reset();
+	open_upvalues = nullptr;
 }
 
-// TODO: consider consolidating these - single function that takes a Data obj.
-
 /**
- * Add a string to memory and return a Value pointing to its location.
+ * Create a global (if it doesn't exist) and return its index.
  * 
- * @param string: string to allocate.
- * @return: Value pointing to Data in memory.
- */
-Value
-VirtualMachine::allocate(std::string string)
-{
-	return memory.allocate(Data(string));
-}
-
-/**
- * Add a Function to memory and return a Value pointing to its location.
- *
- * @param function: shared pointer managing Function to allocate.
- * @return: Value pointing to Data in memory.
+ * @param key: name of global variable.
+ * @return: index in globals.
  */
-Value
-VirtualMachine::allocate(std::shared_ptr<Function> function)
+size_t
+VirtualMachine::global(const std::string key)
 {
-	return memory.allocate(Data(function));
+	if (global_indexes.contains(key)) return global_indexes[key];
+	
+	size_t index = globals.size();
+	globals.push_back(Value(value_type::UNINITIALIZED));
+	global_indexes.insert(std::pair<std::string, size_t>(key, index));
+	return index;
 }
 
 /**
- * Add a Closure to memory and return a Value pointing to its location.
- *
- * @param closure: shared pointer managing Closure to allocate.
- * @return: Value pointing to Data in memory.
+ * Is this variable initialized?
+ * 
+ * @param key: name of global variable.
+ * @return: true if variable initialized, false otherwise.
  */
-Value
-VirtualMachine::allocate(std::shared_ptr<Closure> closure)
+bool
+VirtualMachine::check_global(const std::string& key)
 {
-	return memory.allocate(Data(closure));
+	auto index = global_indexes.find(key);
+	if (index == global_indexes.end()) return false;
+	return !globals[index->second].match_type(value_type::UNINITIALIZED);
 }
 
 /**
- * Add a BuiltinFunction to memory and return a Value pointing to its location.
- *
- * @param builtin: shared pointer managing BuiltinFunction to allocate.
- * @return: Value pointing to Data in memory.
+ * Look up the opcode the compiler can use for a two-argument call to a global.
+ * 
+ * @param key: name of global variable.
+ * @return: opcode (if the global is an operator with one) or -1 (otherwise).
  */
-Value
-VirtualMachine::allocate(std::shared_ptr<BuiltinFunction> builtin)
+int
+VirtualMachine::primitive_opcode(const std::string key)
 {
-	return memory.allocate(Data(builtin));
+	auto entry = primitive_opcodes.find(key);
+	return entry == primitive_opcodes.end() ? -1 : entry->second;
 }
 
 /**
- * Add a Pair to memory and return a Value pointing to its location.
- *
- * @param pair: Pair to allocate.
- * @return: Value pointing to Data in memory.
+ * Print the most frequent pairs of consecutive opcodes executed so far, and
+ * the share of all dispatches each accounts for. Only available when built
+ * with PROFILE_OPCODE_PAIRS.
  */
-Value
-VirtualMachine::allocate(Pair pair)
+void
+VirtualMachine::print_opcode_pairs()
 {
-	return memory.allocate(Data(pair));
+#ifdef PROFILE_OPCODE_PAIRS
+	constexpr size_t SHOWN = 24;
+	struct Pair { uint8_t first; uint8_t second; size_t count; };
+	std::vector<Pair> pairs;
+	size_t total = 0;
+
+	for (size_t first = 0; first < opcode::OPCODE_COUNT; first++) {
+		for (size_t second = 0; second < opcode::OPCODE_COUNT; second++) {
+			size_t count = opcode_pairs[first][second];
+			if (count == 0) continue;
+			pairs.push_back(Pair{ static_cast<uint8_t>(first), static_cast<uint8_t>(second), count });
+			total += count;
+		}
+	}
+	std::sort(pairs.begin(), pairs.end(), [](Pair& a, Pair& b) { return a.count > b.count; });
+
+	std::cerr << "== OPCODE PAIRS (" << total << " dispatches) ==\n";
+	for (size_t i = 0; i < pairs.size() && i < SHOWN; i++) {
+		std::string pair = std::string(opcodeName(pairs[i].first)) + " + " + opcodeName(pairs[i].second);
+		std::cerr << std::left << std::setfill(' ') << std::setw(40) << pair
+			<< std::right << std::setw(12) << pairs[i].count
+			<< std::setw(7) << std::fixed << std::setprecision(2)
+			<< 100.0 * pairs[i].count / total << "%\n";
+	}
+#endif
 }
 
 /**
- * Create a global (if it doesn't exist) and return its index.
+ * Look up the builtin behind an operator with its own opcode, for evaluating
+ * calls at compile time. Operators have no side effects.
  * 
  * @param key: name of global variable.
- * @return: index in globals.
+ * @return: builtin (if the global is an operator that still holds it) or
+ *          nullptr (otherwise).
  */
-size_t
-VirtualMachine::global(const std::string key)
+BuiltinFunction*
+VirtualMachine::pure_builtin(const std::string key)
 {
-	if (global_indexes.contains(key)) return global_indexes[key];
-	
-	size_t index = globals.size();
-	globals.push_back(Value(value_type::UNINITIALIZED));
-	global_indexes.insert(std::pair<std::string, size_t>(key, index));
-	return index;
+	int op = primitive_opcode(key);
+	if (op < 0 || !primitive_intact(op)) return nullptr;
+	return primitives[op].builtin->cast<BuiltinFunction>();
 }
 
 /**
- * Is this variable initialized?
- * 
- * @param key: name of global variable.
- * @return: true if variable initialized, false otherwise.
+ * Print the call site feedback gathered so far for every function in memory,
+ * e.g. to find megamorphic calls. Functions without call sites are skipped.
  */
-bool
-VirtualMachine::check_global(const std::string key)
+void
+VirtualMachine::print_call_sites()
 {
-	if (!global_indexes.contains(key)) return false;
-	return (globals[global_indexes[key]].type != value_type::UNINITIALIZED);
+	memory.for_each([](Data* object) {
+		if (object->type != data_type::FUNCTION) return;
+		auto function = object->cast<Function>();
+		if (function->bytecode.call_sites.empty()) return;
+		disassembleCallSites(function->bytecode,
+			function->anonymous() ? "lambda" : function->name);
+	});
 }
 
 // TODO: might want to just read the uint16 and move the ip in calling code.
@@ -181,7 +242,22 @@ VirtualMachine::read_uint16_and_update_ip(uint8_t*& ip)
 }
 
 /**
- * Scan, compile, and run the source code, printing the result.
+ * Read a little-endian uint32 operand (after a WIDE prefix) and move past it.
+ *
+ * @param ip: instruction pointer at the operand.
+ * @return: value of the operand.
+ */
+uint32_t
+VirtualMachine::read_uint32_and_update_ip(uint8_t*& ip)
+{
+	uint32_t value = 0;
+	for (size_t byte = 4; byte > 0; byte--) value = value * 256 + ip[byte - 1];
+	ip += 4;
+	return value;
+}
+
+/**
+ * Parse, optimize, compile, and run the source code, printing the result.
  * 
  * @param source: source code.
  * 
@@ -190,15 +266,20 @@ interpret_result
 VirtualMachine::interpret(std::string& source)
 {
 	Scanner scanner(source);
-	Compiler compiler(scanner, *this);
+	Parser parser(scanner, passes.lazy());
+
+	Program program = passes.time("parse", [&]() { return parser.parse(); });
+	if (parser.error()) return interpret_result::COMPILE_ERROR;
 
-	auto function = compiler.compile();
+	passes.run(program);
+
+	Compiler compiler(*this);
+	auto function = passes.time("codegen", [&]() { return compiler.compile(program); });
 	if (function == nullptr) return interpret_result::COMPILE_ERROR;
 
-	auto script = Data(function);
-	auto closure = Data(std::make_shared<Closure>(&script));
-	stack.push_back(Value(&closure));
-	call(0);
+	auto closure = allocate<Closure>(function);
+	stack_push(Value(closure));
+	if (!call(0)) return interpret_result::RUNTIME_ERROR;
 
 	memory.gc_active = true;
 	auto result = run();
@@ -216,7 +297,7 @@ VirtualMachine::interpret(std::string& source)
 bool
 VirtualMachine::truth_value(Value val)
 {
-	return (val.type == value_type::BOOL) ? val.as.boolean : true;
+	return val.match_type(value_type::BOOL) ? val.as_boolean() : true;
 }
 
 // TODO: revisit error handling.
@@ -236,16 +317,18 @@ VirtualMachine::call(size_t number_arguments)
 	Value val = stack_peek(number_arguments);
 
 	if (val.match_data_type(data_type::CLOSURE)) {
-		using clos_t = std::shared_ptr<Closure>;
-		auto closure = std::any_cast<clos_t>(val.as.data->data);
+		auto closure = val.as_data()->cast<Closure>();
 		result = call(closure, number_arguments);
 	}
 
 	else if (val.match_data_type(data_type::BUILTIN)) {
-		using func_t = std::shared_ptr<BuiltinFunction>;
-		auto function = std::any_cast<func_t>(val.as.data->data);
+		auto function = val.as_data()->cast<BuiltinFunction>();
 		result = call(function, number_arguments);
 	}
+
+	else {
+		runtime_error("Can only call functions", 0);
+	}
 	
 	return result;
 }
@@ -258,15 +341,121 @@ VirtualMachine::call(size_t number_arguments)
  * @return: call success status. (under construction)
  */
 bool
-VirtualMachine::call(const std::shared_ptr<Closure> closure, size_t number_arguments)
+VirtualMachine::call(Closure* closure, size_t number_arguments)
 {
+	if (closure->function->arity != number_arguments) {
+		arity_error(closure->function->arity, number_arguments);
+		return false;
+	}
+	return push_frame(closure, number_arguments);
+}
+
+/**
+ * Set up the frame for a call to a closure whose arity is already known to
+ * match the number of arguments.
+ *
+ * @param closure: closure being called.
+ * @param number_arguments: number of arguments in the call.
+ * @return: call success status.
+ */
+inline bool
+VirtualMachine::push_frame(Closure* closure, size_t number_arguments)
+{
+	Function* function = closure->function;
+	if (function->lazy && !compile_lazy(function)) return false;
+
+	if (frames.size() == RECURSION_MAX) {
+		runtime_error("Maximum recursion depth exceeded", 0);
+		return false;
+	}
+
+	// Check once for the whole frame, rather than on every push.
+	if (function->stack_size > static_cast<size_t>(stack.data() + STACK_MAX - stack_top)) {
+		runtime_error("Stack overflow", 0);
+		return false;
+	}
+
 	CallFrame frame{
 		.closure = closure,
-		.ip = &closure->function_ptr()->bytecode.instructions[0],
-		.stack_index = stack.size() - number_arguments - 1};
+		.function = function,
+		.chunk = &function->bytecode,
+		.ip = function->bytecode.instructions.data(),
+		.stack_index = static_cast<size_t>(stack_top - stack.data()) - number_arguments - 1};
 
 	frames.push_back(frame);
-	return true;  // TODO: check result?
+	return true;
+}
+
+/**
+ * Keep what is needed to compile a function's body on its first call.
+ *
+ * @param function: function with the 'lazy' flag set.
+ * @param body: lazy lambda for the function, and its upvalues.
+ */
+void
+VirtualMachine::defer(Function* function, LazyFunction body)
+{
+	lazy_functions.insert_or_assign(function, std::move(body));
+}
+
+/**
+ * Parse, optimize, and compile the body of a function before its first call.
+ * Nothing allocated while compiling is reachable until the body is complete,
+ * so the garbage collector is paused.
+ *
+ * @param function: function with the 'lazy' flag set.
+ * @return: was the body compiled without errors?
+ */
+bool
+VirtualMachine::compile_lazy(Function* function)
+{
+	auto& body = lazy_functions.at(function);
+	auto& node = *body.node;
+	bool active = memory.gc_active;
+	memory.gc_active = false;
+
+	Scanner scanner(node.source);
+	Parser parser(scanner, true);
+	node.body = passes.time("parse", [&]() { return parser.parse(); });
+	bool compiled = !parser.error();
+	if (compiled) {
+		passes.run(node, body.captured);
+		compiled = passes.time("codegen", [&]() {
+			return Compiler::recompile(*this, function, node, body.captured, body.copied);
+		});
+	}
+	memory.gc_active = active;
+
+	if (!compiled) {
+		function->lazy = true;  // Report the error again on the next call.
+		runtime_error("Error compiling function", 0);
+		return false;
+	}
+	lazy_functions.erase(function);
+	return true;
+}
+
+/**
+ * Forget lazy functions the garbage collector is about to free. Called after
+ * marking and before sweeping.
+ */
+void
+VirtualMachine::gc_sweep_lazy()
+{
+	std::erase_if(lazy_functions, [](auto& entry) { return !entry.first->reachable; });
+}
+
+/**
+ * Report a call with the wrong number of arguments.
+ *
+ * @param arity: number of arguments expected by the callee.
+ * @param number_arguments: number of arguments in the call.
+ */
+void
+VirtualMachine::arity_error(size_t arity, size_t number_arguments)
+{
+	runtime_error("Expected " + std::to_string(arity) + " arguments but got " +
+		std::to_string(number_arguments), 0);
 }
 
 /**
@@ -277,62 +466,375 @@ VirtualMachine::call(const std::shared_ptr<Closure> closure, size_t number_argum
  * @return: call success status. (under construction)
  */
 bool
-VirtualMachine::call(std::shared_ptr<BuiltinFunction> function, size_t number_arguments)
+VirtualMachine::call(BuiltinFunction* function, size_t number_arguments)
 {
-	auto iterator = stack.begin() + stack.size() - number_arguments;
-	Value result = function->call(iterator, number_arguments);
+	if (function->arity != number_arguments) {
+		arity_error(function->arity, number_arguments);
+		return false;
+	}
 
-	stack.erase(stack.begin() + stack.size() - number_arguments - 1, stack.end());
-	stack.push_back(result);
+	Value* args = stack_top - number_arguments;
+	Value result = function->call(args, number_arguments);
+
+	// Replace the function and its arguments with the result.
+	stack_top = args - 1;
+	stack_push(result);
 
 	return true;  // TODO: check result?
 }
 
 /**
- * Handle upvalue capture by either creating an upvalue if none exists or
- * reusing it if it does exist. This ensures that two closures that capture the
- * same variable reference the same upvalue.
+ * Record a call in its call site's feedback - the callee, which is cached if
+ * there is room, and the types of the leading arguments. Callees are only
+ * cached once their arity has been checked against the call site.
  * 
- * @param index: stack index of upvalue to capture.
- * @return: shared pointer to captured upvalue.
+ * @param site: feedback for the call site.
+ * @param callee: stack slot holding the callee, followed by the arguments.
+ * @param number_arguments: number of arguments in the call.
+ * @return: cache entry for the callee, or nullptr if it isn't cached.
  */
-std::shared_ptr<RuntimeUpvalue>
-VirtualMachine::capture_upvalue(size_t index)
+CallSite::Entry*
+VirtualMachine::record_call(CallSite& site, Value* callee, size_t number_arguments)
 {
-	auto upvalue = std::make_shared<RuntimeUpvalue>(index);
+	Data* target;
+	size_t arity;
+	bool closure = callee->match_data_type(data_type::CLOSURE);
+	if (closure) {
+		Function* function = callee->as_data()->cast<Closure>()->function;
+		target = function;
+		arity = function->arity;
+	}
+	else if (callee->match_data_type(data_type::BUILTIN)) {
+		target = callee->as_data();
+		arity = target->cast<BuiltinFunction>()->arity;
+	}
+	else return nullptr;
 
-	auto start = open_upvalues.begin();
-	auto end = open_upvalues.end();
-	for (auto& i = start; i != end; i++) {
-		if ((*i)->index == upvalue->index) return *i;
+	CallSite::Entry* entry = nullptr;
+	for (size_t i = 0; i < site.size; i++) {
+		if (site.entries[i].target == target) {
+			entry = &site.entries[i];
+			break;
+		}
+	}
 
-		if ((*i)->index > index) {
-			open_upvalues.insert(i, upvalue);
-			return upvalue;
+	if (entry == nullptr) {
+		if (arity != number_arguments) return nullptr;
+		if (site.size == CallSite::CACHE_SIZE) {
+			site.megamorphic = true;
+			return nullptr;
 		}
+		entry = &site.entries[site.size++];
+		entry->target = target;
+		entry->closure = closure;
 	}
 
-	open_upvalues.push_back(upvalue);
+	entry->count++;
+	size_t typed = std::min(number_arguments, CallSite::TYPED_ARGUMENTS);
+	for (size_t i = 0; i < typed; i++) {
+		entry->argument_types[i] |= 1 << static_cast<int>(callee[i + 1].type());
+	}
+	return entry;
+}
+
+/**
+ * Execute a generic call, using the call site's inline cache to dispatch
+ * straight to a callee it has seen before. Monomorphic sites are quickened.
+ * 
+ * @param site: index of the call site in the current frame's bytecode.
+ * @param instruction: pointer to the CALL opcode, or nullptr if the call site
+ *     should not be quickened.
+ * @param number_arguments: number of arguments in the call.
+ * @return: call success status.
+ */
+bool
+VirtualMachine::call_site(size_t site, uint8_t* instruction, size_t number_arguments)
+{
+	CallSite& feedback = frames.back().chunk->call_sites[site];
+	Value* callee = stack_top - number_arguments - 1;
+	auto entry = record_call(feedback, callee, number_arguments);
+	if (entry == nullptr) return call(number_arguments);
+
+	if (instruction != nullptr && feedback.state() == call_site_state::MONOMORPHIC) {
+		quicken_call(instruction, *callee);
+	}
+
+	// Arity was checked when the callee was cached.
+	if (entry->closure) return push_frame(callee->as_data()->cast<Closure>(), number_arguments);
+	return call(callee->as_data()->cast<BuiltinFunction>(), number_arguments);
+}
+
+/**
+ * Rewrite a generic CALL in place to a variant specialized for the callee it
+ * has just seen. Each variant checks that its callee still matches, and turns
+ * back into a generic CALL if it doesn't.
+ * 
+ * @param instruction: pointer to the CALL opcode in the current frame.
+ * @param callee: Value being called.
+ */
+void
+VirtualMachine::quicken_call(uint8_t* instruction, Value callee)
+{
+	if (callee.match_data_type(data_type::CLOSURE)) {
+		auto closure = callee.as_data()->cast<Closure>();
+		*instruction = closure->function == frames.back().function ?
+			opcode::CALL_SAME_FUNCTION : opcode::CALL_CLOSURE;
+	}
+
+	else if (callee.match_data_type(data_type::BUILTIN)) {
+		*instruction = opcode::CALL_BUILTIN;
+	}
+}
+
+/**
+ * Has the global for this operator kept its original builtin? If so, its
+ * opcode can compute the result directly.
+ * 
+ * @param op: opcode implementing the operator.
+ * @return: does the global still hold the builtin?
+ */
+inline bool
+VirtualMachine::primitive_intact(uint8_t op)
+{
+	Value val = globals[primitives[op].global];
+	return val.match_type(value_type::DATA) && val.as_data() == primitives[op].builtin;
+}
+
+/**
+ * Do all operators with their own opcode still hold their builtins?
+ * 
+ * @return: are the operators' globals unchanged?
+ */
+bool
+VirtualMachine::primitives_intact()
+{
+	for (auto& [name, op] : primitive_opcodes) {
+		if (!primitive_intact(op)) return false;
+	}
+	return true;
+}
+
+/**
+ * Fall back from an operator's opcode to a regular call of whatever its global
+ * currently holds. The callee is inserted under the two arguments on the stack.
+ * 
+ * @param op: opcode implementing the operator.
+ * @return: call success status.
+ */
+bool
+VirtualMachine::call_primitive(uint8_t op)
+{
+	Value* args = stack_top - 2;
+	args[2] = args[1];
+	args[1] = args[0];
+	args[0] = globals[primitives[op].global];
+	stack_top++;
+	return call(2);
+}
+
+/**
+ * Handle upvalue capture by either creating an upvalue if none exists or
+ * reusing it if it does exist. This ensures that two closures that capture the
+ * same variable reference the same upvalue.
+ * 
+ * @param local: stack slot of upvalue to capture.
+ * @return: pointer to captured upvalue.
+ */
+RuntimeUpvalue*
+VirtualMachine::capture_upvalue(Value* local)
+{
+	RuntimeUpvalue** link = &open_upvalues;
+	while (*link != nullptr && (*link)->location > local) {
+		link = &(*link)->next_open;
+	}
+
+	if (*link != nullptr && (*link)->location == local) return *link;
+
+	auto upvalue = allocate<RuntimeUpvalue>(local);
+	upvalue->next_open = *link;
+	*link = upvalue;
 	return upvalue;
 }
 
 /**
- * Prints the current bytecode instruction - used for debugging.
+ * Prints the current bytecode instruction and advances the line count - used
+ * for debugging.
  * 
- * @param line: line of code corresponding to instruction.
+ * @param ip: pointer to the instruction in the current frame's bytecode.
+ * @param line: line of code corresponding to instruction, will be updated.
  */
 void
-VirtualMachine::disassemble_current_instruction(size_t line)
+VirtualMachine::trace_instruction(uint8_t* ip, size_t& line)
 {
-	auto& function = frames.back().closure->function_ptr()->bytecode;
-	auto* start = function.instructions.data();
-	disassembleInstruction(function, frames.back().ip - start, line);
+	auto& function = *frames.back().chunk;
+	auto offset = ip - function.instructions.data();
+	size_t print_line = line;
+	disassembleInstruction(function, offset, print_line);
+	// TODO: different line determination system
+	if (function.newlines[offset]) ++line;
 }
 
 
 // TODO: clean up switch block formatting or break into functions
 // TODO: index instead of pointer?
 
+/* Instruction dispatch. With COMPUTED_GOTO, each handler jumps directly to the
+ * next handler through a table of label addresses indexed by opcode, giving
+ * every handler its own indirect branch (and branch prediction history).
+ * Otherwise, every instruction goes back through a single switch. */
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION() trace_instruction(ip, line)
+#else
+#define TRACE_INSTRUCTION()
+#endif
+
+#ifdef PROFILE_OPCODE_PAIRS
+#define PROFILE_INSTRUCTION() \
+	opcode_pairs[previous_opcode][*ip]++; \
+	previous_opcode = *ip
+#else
+#define PROFILE_INSTRUCTION()
+#endif
+
+#ifdef COMPUTED_GOTO
+#define INSTRUCTION(name) op_##name
+#define UNKNOWN_INSTRUCTION op_UNKNOWN
+#define DISPATCH() \
+	TRACE_INSTRUCTION(); \
+	PROFILE_INSTRUCTION(); \
+	goto *dispatch_table[*ip++];
+#define NEXT DISPATCH()
+#else
+#define INSTRUCTION(name) case opcode::name
+#define UNKNOWN_INSTRUCTION default
+#define DISPATCH() \
+	TRACE_INSTRUCTION(); \
+	PROFILE_INSTRUCTION(); \
+	switch (*ip++)
+#define NEXT break
+#endif
+
+/* The state of the current frame is kept in locals while it executes, along
+ * with the stack top. They must be stored before anything that reads frames or
+ * the stack (calls, errors, GC) and loaded again whenever the frame changes. */
+#define LOAD_FRAME() \
+	ip = frames.back().ip; \
+	slots = stack.data() + frames.back().stack_index; \
+	constants = frames.back().chunk->constants.data(); \
+	upvalues = frames.back().closure->upvalues.data(); \
+	captures = frames.back().closure->captures.data(); \
+	sites = frames.back().chunk->call_sites.data(); \
+	sp = stack_top
+#define STORE_FRAME() \
+	frames.back().ip = ip; \
+	stack_top = sp
+
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define PEEK(depth) (sp[-1 - (depth)])
+
+// TODO: this isn't reporting correctly
+#define PUSH_GLOBAL(index) \
+	if (globals[index].match_type(value_type::UNINITIALIZED)) { \
+		STORE_FRAME(); \
+		runtime_error("Uninitialized variable", line); \
+		return interpret_result::RUNTIME_ERROR; \
+	} \
+	PUSH(globals[index])
+
+// Rebinding an operator's global turns off the typed opcodes' fast path for
+// good - values computed by the replacement may be in variables typed numbers.
+#define POP_GLOBAL(index) \
+	globals[index] = POP(); \
+	if (index < operator_globals && operators_intact) operators_intact = primitives_intact()
+
+// Generic call through the call site's inline cache - quickened if possible.
+#define CALL_SITE(number_arguments) { \
+	size_t site = read_uint16_and_update_ip(ip); \
+	STORE_FRAME(); \
+	if (!call_site(site, ip - 3, (number_arguments))) return interpret_result::RUNTIME_ERROR; \
+	LOAD_FRAME(); \
+}
+
+// Self tail call - the new arguments replace the parameters.
+#define LOOP_TO_START(jump) { \
+	size_t arity = frames.back().function->arity; \
+	if (open_upvalues != nullptr && open_upvalues->location >= slots) { \
+		close_last_frame_upvalues(); \
+	} \
+	Value* arguments = sp - arity; \
+	for (size_t i = 0; i < arity; i++) slots[i + 1] = arguments[i]; \
+	sp = slots + arity + 1; \
+	ip -= (jump); \
+}
+
+// Leave the result of an inlined call in place of its locals.
+#define LEAVE_SCOPE(count) { \
+	Value* first = sp - (count) - 1; \
+	close_upvalues(first); \
+	*first = sp[-1]; \
+	sp = first + 1; \
+}
+
+// Create a closure, capturing the variables that follow the function's index.
+// Values are copied straight from the enclosing frame or closure. The closure
+// must be on the stack before upvalues are allocated.
+#define MAKE_CLOSURE(index, read_index) { \
+	Value val = constants[(index)]; \
+	if (!val.match_data_type(data_type::FUNCTION)) return interpret_result::RUNTIME_ERROR; \
+	STORE_FRAME(); \
+	auto closure = allocate<Closure>(val.as_data()->cast<Function>()); \
+	PUSH(Value(closure)); \
+	stack_top = sp; \
+	size_t count = closure->function->upvalues + closure->function->captures; \
+	closure->upvalues.reserve(closure->function->upvalues); \
+	closure->captures.reserve(closure->function->captures); \
+	for (size_t i = 0; i < count; i++) { \
+		auto flags = *ip++; \
+		size_t up_index = read_index(ip); \
+		if (flags & capture::COPY) { \
+			closure->captures.push_back(flags & capture::LOCAL ? \
+				slots[up_index + 1] : captures[up_index]); \
+		} \
+		else if (flags & capture::LOCAL) { \
+			closure->upvalues.push_back(capture_upvalue(slots + up_index + 1)); \
+		} \
+		else { \
+			closure->upvalues.push_back(upvalues[up_index]); \
+		} \
+	} \
+}
+
+// Numeric fast path for an operator's opcode, otherwise a regular call.
+#define BINARY_OPERATION(op, operator) { \
+	Value right = PEEK(0); \
+	Value left = PEEK(1); \
+	if (left.match_type(value_type::NUMBER) && \
+		right.match_type(value_type::NUMBER) && \
+		primitive_intact(opcode::op)) { \
+		sp[-2] = Value(left.as_number() operator right.as_number()); \
+		--sp; \
+	} \
+	else { \
+		STORE_FRAME(); \
+		if (!call_primitive(opcode::op)) return interpret_result::RUNTIME_ERROR; \
+		LOAD_FRAME(); \
+	} \
+}
+
+// Operands known to be numbers - only the operators need checking. Once one
+// has been rebound, every typed opcode makes a regular call.
+#define NUMBER_OPERATION(op, operator) \
+	if (operators_intact) { \
+		sp[-2] = Value(sp[-2].as_number() operator sp[-1].as_number()); \
+		--sp; \
+	} \
+	else { \
+		STORE_FRAME(); \
+		if (!call_primitive(opcode::op)) return interpret_result::RUNTIME_ERROR; \
+		LOAD_FRAME(); \
+	}
+
 /**
  * Execute the program. Obtains current instruction and executes it in a loop.
  * 
@@ -345,214 +847,597 @@ VirtualMachine::run()
 /* TODO: rewrite line calculation. Want to move off of newline system. */
 
 #ifdef DEBUG_TRACE_EXECUTION
-	size_t line = frames.back().closure->function_ptr()->bytecode.base_line;
+	size_t line = frames.back().chunk->base_line;
 #else
 	size_t line = 0;  // TEMP
 #endif
 
-	for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-		{
-			disassemble_current_instruction(line);
-			// TODO: different line determination system
-			auto& function = frames.back().closure->function_ptr()->bytecode;
-			auto offset = frames.back().ip - function.instructions.data();
-			if (function.newlines[offset]) ++line;
-		};
+#ifdef COMPUTED_GOTO
+	void* dispatch_table[opcode::OPCODE_COUNT];
+	for (auto& target : dispatch_table) target = &&op_UNKNOWN;
+#define TARGET(name) dispatch_table[opcode::name] = &&op_##name
+	TARGET(CONSTANT);
+	TARGET(DEFINE_GLOBAL);
+	TARGET(GET_GLOBAL);
+	TARGET(SET_GLOBAL);
+	TARGET(GET_UPVALUE);
+	TARGET(SET_UPVALUE);
+	TARGET(GET_CAPTURED);
+	TARGET(GET_LOCAL);
+	TARGET(SET_LOCAL);
+	TARGET(JUMP);
+	TARGET(JUMP_IF_FALSE);
+	TARGET(JUMP_IF_TRUE);
+	TARGET(LOOP);
+	TARGET(END_SCOPE);
+	TARGET(TAIL_CALL);
+	TARGET(CALL);
+	TARGET(CALL0);
+	TARGET(CALL1);
+	TARGET(CALL2);
+	TARGET(CALL3);
+	TARGET(CALL_CLOSURE);
+	TARGET(CALL_BUILTIN);
+	TARGET(CALL_SAME_FUNCTION);
+	TARGET(GET_LOCAL_CONSTANT);
+	TARGET(GET_LOCAL_LOCAL);
+	TARGET(GET_GLOBAL_LOCAL);
+	TARGET(POP_GET_LOCAL);
+	TARGET(POP_GET_GLOBAL);
+	TARGET(JUMP_IF_FALSE_POP);
+	TARGET(GET_LOCAL_0);
+	TARGET(GET_LOCAL_1);
+	TARGET(GET_LOCAL_2);
+	TARGET(GET_LOCAL_3);
+	TARGET(GET_LOCAL_SHORT);
+	TARGET(GET_GLOBAL_SHORT);
+	TARGET(CONSTANT_SHORT);
+	TARGET(SMALL_INT);
+	TARGET(WIDE);
+	TARGET(CLOSURE);
+	TARGET(ADD);
+	TARGET(SUBTRACT);
+	TARGET(MULTIPLY);
+	TARGET(EQUAL);
+	TARGET(LESS);
+	TARGET(GREATER);
+	TARGET(ADD_NUMBERS);
+	TARGET(SUBTRACT_NUMBERS);
+	TARGET(MULTIPLY_NUMBERS);
+	TARGET(EQUAL_NUMBERS);
+	TARGET(LESS_NUMBERS);
+	TARGET(GREATER_NUMBERS);
+	TARGET(NOT);
+	TARGET(TRUE);
+	TARGET(FALSE);
+	TARGET(NIL);
+	TARGET(POP);
+	TARGET(RETURN);
+#undef TARGET
 #endif
-		switch (uint8_t instruction = *frames.back().ip++) {
-			case opcode::CONSTANT: {
-				size_t index = read_uint16_and_update_ip(frames.back().ip);
-				auto& closure = frames.back().closure;
-				auto& bytecode = closure->function_ptr()->bytecode;
-				stack.push_back(bytecode.constants[index]);
-				}
-				break;
-			case opcode::DEFINE_GLOBAL: {
-				size_t index = read_uint16_and_update_ip(frames.back().ip);
-				globals[index] = stack_pop();  // TODO: consider unsigned Value
-				}
-				break;
-			case opcode::GET_GLOBAL: {
+
+	uint8_t* ip;
+	Value* slots;  // Frame's closure, followed by its arguments and locals.
+	Value* constants;
+	RuntimeUpvalue** upvalues;
+	Value* captures;
+	CallSite* sites;
+	Value* sp;
+	LOAD_FRAME();
+
+	for (;;) {
+		DISPATCH() {
+			INSTRUCTION(CONSTANT): {
+				size_t index = read_uint16_and_update_ip(ip);
+				PUSH(constants[index]);
+				}
+				NEXT;
+			INSTRUCTION(DEFINE_GLOBAL): {
+				size_t index = read_uint16_and_update_ip(ip);
+				POP_GLOBAL(index);  // TODO: consider unsigned Value
+				}
+				NEXT;
+			INSTRUCTION(GET_GLOBAL): {
 				// TODO: instead get the global at this index
 				// Need "undefined" value - similar to how Python does it
-				size_t index = read_uint16_and_update_ip(frames.back().ip);
-				if (globals[index].type == value_type::UNINITIALIZED) {
-					// TODO: this isn't reporting correctly
-					runtime_error("Uninitialized variable", line);
-					return interpret_result::RUNTIME_ERROR;
-				}
-				stack.push_back(globals[index]);
+				size_t index = read_uint16_and_update_ip(ip);
+				PUSH_GLOBAL(index);
 				}
-				break;
+				NEXT;
 			// TODO: consider consolidating into DEFINE_GLOBAL
-			case opcode::SET_GLOBAL: {
-				size_t index = read_uint16_and_update_ip(frames.back().ip);
-				globals[index] = stack_pop();
-				}
-				break;
-			case opcode::GET_UPVALUE: {
-				size_t index = read_uint16_and_update_ip(frames.back().ip);
-				auto& upvalue = frames.back().closure->upvalues[index];
-				if (upvalue->data.type != value_type::UNINITIALIZED)
-					stack.push_back(upvalue->data);
-				else stack.push_back(stack[upvalue->index]);
-				}
-				break;
+			INSTRUCTION(SET_GLOBAL): {
+				size_t index = read_uint16_and_update_ip(ip);
+				POP_GLOBAL(index);
+				}
+				NEXT;
+			INSTRUCTION(GET_UPVALUE): {
+				size_t index = read_uint16_and_update_ip(ip);
+				PUSH(*upvalues[index]->location);
+				}
+				NEXT;
 			// TODO: test this - both cases
-			case opcode::SET_UPVALUE: {
-				size_t index = read_uint16_and_update_ip(frames.back().ip);
-				auto& upvalue = frames.back().closure->upvalues[index];
-				if (upvalue->data.type != value_type::UNINITIALIZED)
-					upvalue->data = stack_pop();
-				else stack[upvalue->index] = stack_pop();
-				}
-				break;
-			case opcode::GET_LOCAL: {
-				size_t index = read_uint16_and_update_ip(frames.back().ip);
-				// TODO: make sure this still indexes correctly
-				stack.push_back(stack[frames.back().stack_index + index + 1]);
-				}
-				break;
+			INSTRUCTION(SET_UPVALUE): {
+				size_t index = read_uint16_and_update_ip(ip);
+				*upvalues[index]->location = POP();
+				}
+				NEXT;
+			INSTRUCTION(GET_CAPTURED): {
+				size_t index = read_uint16_and_update_ip(ip);
+				PUSH(captures[index]);
+				}
+				NEXT;
+			INSTRUCTION(GET_LOCAL): {
+				size_t index = read_uint16_and_update_ip(ip);
+				PUSH(slots[index + 1]);
+				}
+				NEXT;
 			// TODO: write test cases for this.
-			case opcode::SET_LOCAL: {
-				size_t index = read_uint16_and_update_ip(frames.back().ip);
-				stack[frames.back().stack_index + index + 1] = stack_pop();
+			INSTRUCTION(SET_LOCAL): {
+				size_t index = read_uint16_and_update_ip(ip);
+				slots[index + 1] = POP();
 				}
-				break;
-			case opcode::JUMP: {
-				frames.back().ip += read_uint16_and_update_ip(frames.back().ip);
+				NEXT;
+			INSTRUCTION(JUMP): {
+				ip += read_uint16_and_update_ip(ip);
 				}
-				break;
-			case opcode::JUMP_IF_FALSE: {
-				size_t jump = read_uint16_and_update_ip(frames.back().ip);
-				if (stack_peek(0).type == value_type::BOOL &&
-					stack_peek(0).as.boolean == false)
-					frames.back().ip += jump;
+				NEXT;
+			INSTRUCTION(JUMP_IF_FALSE): {
+				size_t jump = read_uint16_and_update_ip(ip);
+				if (PEEK(0).match_type(value_type::BOOL) &&
+					PEEK(0).as_boolean() == false)
+					ip += jump;
 				}
-				break;
-			case opcode::TAIL_CALL: {
-				size_t number_arguments = read_uint16_and_update_ip(frames.back().ip);
+				NEXT;
+			INSTRUCTION(JUMP_IF_TRUE): {
+				size_t jump = read_uint16_and_update_ip(ip);
+				if (!PEEK(0).match_type(value_type::BOOL) ||
+					PEEK(0).as_boolean() == true)
+					ip += jump;
+				}
+				NEXT;
+			INSTRUCTION(LOOP): {
+				size_t jump = read_uint16_and_update_ip(ip);
+				LOOP_TO_START(jump);
+				}
+				NEXT;
+			INSTRUCTION(END_SCOPE): {
+				size_t count = read_uint16_and_update_ip(ip);
+				LEAVE_SCOPE(count);
+				}
+				NEXT;
+			INSTRUCTION(TAIL_CALL): {
+				size_t site = read_uint16_and_update_ip(ip);
+				size_t number_arguments = sites[site].arguments;
 
-				// Overwrite returning call with tail call
-				auto copy_from = std::prev(stack.end(), number_arguments + 1);
-				auto copy_to = std::next(stack.begin(), frames.back().stack_index);
-				for (size_t i = 0; i < number_arguments + 1; i++) {
-					*copy_to++ = *copy_from++;
+				// The script's frame prints the result when it returns - keep it.
+				if (frames.size() == 1) {
+					STORE_FRAME();
+					if (!call_site(site, nullptr, number_arguments)) return interpret_result::RUNTIME_ERROR;
+					LOAD_FRAME();
+					NEXT;
 				}
 
+				Value* callee = sp - number_arguments - 1;
+				record_call(sites[site], callee, number_arguments);
+
+				// Overwrite returning call with tail call
 				close_last_frame_upvalues();
-				stack.erase(copy_to, stack.end());
+				// Copy upwards - the callee's slots may overlap the frame's.
+				slots[0] = callee[0];
+				switch (number_arguments) {
+					case 0:
+						break;
+					case 1:
+						slots[1] = callee[1];
+						break;
+					case 2:
+						slots[1] = callee[1];
+						slots[2] = callee[2];
+						break;
+					case 3:
+						slots[1] = callee[1];
+						slots[2] = callee[2];
+						slots[3] = callee[3];
+						break;
+					default:
+						for (size_t i = 1; i < number_arguments + 1; i++) {
+							slots[i] = callee[i];
+						}
+				}
+
+				stack_top = slots + number_arguments + 1;
 				frames.pop_back();
 				if (!call(number_arguments)) return interpret_result::RUNTIME_ERROR;
+				LOAD_FRAME();
 				}
-				break;
-			case opcode::CALL: {
-				size_t number_arguments = read_uint16_and_update_ip(frames.back().ip);
-				if (!call(number_arguments)) return interpret_result::RUNTIME_ERROR;
+				NEXT;
+			INSTRUCTION(CALL):
+				CALL_SITE(sites[site].arguments);
+				NEXT;
+			INSTRUCTION(CALL0):
+				CALL_SITE(0);
+				NEXT;
+			INSTRUCTION(CALL1):
+				CALL_SITE(1);
+				NEXT;
+			INSTRUCTION(CALL2):
+				CALL_SITE(2);
+				NEXT;
+			INSTRUCTION(CALL3):
+				CALL_SITE(3);
+				NEXT;
+			INSTRUCTION(CALL_CLOSURE): {
+				size_t site = read_uint16_and_update_ip(ip);
+				size_t number_arguments = sites[site].arguments;
+				Value callee = PEEK(number_arguments);
+				STORE_FRAME();
+				if (callee.match_data_type(data_type::CLOSURE)) {
+					auto closure = callee.as_data()->cast<Closure>();
+					if (!call(closure, number_arguments)) return interpret_result::RUNTIME_ERROR;
+				}
+				else {
+					ip[-3] = opcode::CALL;
+					if (!call_site(site, nullptr, number_arguments)) return interpret_result::RUNTIME_ERROR;
+				}
+				LOAD_FRAME();
+				}
+				NEXT;
+			INSTRUCTION(CALL_BUILTIN): {
+				size_t site = read_uint16_and_update_ip(ip);
+				size_t number_arguments = sites[site].arguments;
+				Value callee = PEEK(number_arguments);
+				STORE_FRAME();
+				if (callee.match_data_type(data_type::BUILTIN)) {
+					// Builtins don't push a frame - only the stack changes.
+					auto builtin = callee.as_data()->cast<BuiltinFunction>();
+					if (!call(builtin, number_arguments)) return interpret_result::RUNTIME_ERROR;
+					sp = stack_top;
+				}
+				else {
+					ip[-3] = opcode::CALL;
+					if (!call_site(site, nullptr, number_arguments)) return interpret_result::RUNTIME_ERROR;
+					LOAD_FRAME();
+				}
+				}
+				NEXT;
+			INSTRUCTION(CALL_SAME_FUNCTION): {
+				size_t site = read_uint16_and_update_ip(ip);
+				size_t number_arguments = sites[site].arguments;
+				Value callee = PEEK(number_arguments);
+				Function* function = frames.back().function;
+				STORE_FRAME();
+				if (!callee.match_data_type(data_type::CLOSURE) ||
+					callee.as_data()->cast<Closure>()->function != function) {
+					ip[-3] = opcode::CALL;
+					if (!call_site(site, nullptr, number_arguments)) return interpret_result::RUNTIME_ERROR;
+					LOAD_FRAME();
+					NEXT;
+				}
+
+				// Recursive call - arity was checked when this call site was
+				// quickened, and constants are shared with the caller, so the
+				// new frame can be set up without reloading everything.
+				auto closure = callee.as_data()->cast<Closure>();
+				if (!push_frame(closure, number_arguments)) return interpret_result::RUNTIME_ERROR;
+				ip = function->bytecode.instructions.data();
+				slots = sp - number_arguments - 1;
+				upvalues = closure->upvalues.data();
+				captures = closure->captures.data();
 				}
-				break;
-			case opcode::CLOSURE: {
-				size_t index = read_uint16_and_update_ip(frames.back().ip);
-				Value val = frames.back().closure->function_ptr()->bytecode.constants[index];
-				if (!val.match_data_type(data_type::FUNCTION)) return interpret_result::RUNTIME_ERROR;
-				auto closure = std::make_shared<Closure>(val.as.data);
-
-				// TODO: make sure this works with GC
-				stack.push_back(allocate(closure));
-
-				size_t count = std::any_cast<std::shared_ptr<Function>>(closure->function->data)->upvalues;
-				for (size_t i = 0; i < count; i++) {
-					auto local = *frames.back().ip++;
-					auto up_index = read_uint16_and_update_ip(frames.back().ip);
-
-					if (local) {
-						auto upvalue = capture_upvalue(frames.back().stack_index + up_index + 1);
-						closure->upvalues.push_back(upvalue);
-					}
-
-					else {
-						auto upvalue = frames.back().closure->upvalues[up_index];
-						closure->upvalues.push_back(upvalue);
-					}
-				}
-				}
-				break;
-			case opcode::NOT:
-				stack.push_back(Value(!truth_value(stack_pop())));
-				break;
-			case opcode::TRUE:
-				stack.push_back(Value(true));
-				break;
-			case opcode::FALSE:
-				stack.push_back(Value(false));
-				break;
-			case opcode::NIL:
-				stack.push_back(Value(value_type::NIL));
-				break;
-			case opcode::POP:
-				stack_pop();
-				break;
-			case opcode::RETURN: {
-				Value result = stack_pop();
+				NEXT;
+			INSTRUCTION(CLOSURE): {
+				size_t index = read_uint16_and_update_ip(ip);
+				MAKE_CLOSURE(index, read_uint16_and_update_ip);
+				}
+				NEXT;
+			INSTRUCTION(ADD):
+				BINARY_OPERATION(ADD, +);
+				NEXT;
+			INSTRUCTION(SUBTRACT):
+				BINARY_OPERATION(SUBTRACT, -);
+				NEXT;
+			INSTRUCTION(MULTIPLY):
+				BINARY_OPERATION(MULTIPLY, *);
+				NEXT;
+			INSTRUCTION(EQUAL):
+				BINARY_OPERATION(EQUAL, ==);
+				NEXT;
+			INSTRUCTION(LESS):
+				BINARY_OPERATION(LESS, <);
+				NEXT;
+			INSTRUCTION(GREATER):
+				BINARY_OPERATION(GREATER, >);
+				NEXT;
+			INSTRUCTION(ADD_NUMBERS):
+				NUMBER_OPERATION(ADD, +);
+				NEXT;
+			INSTRUCTION(SUBTRACT_NUMBERS):
+				NUMBER_OPERATION(SUBTRACT, -);
+				NEXT;
+			INSTRUCTION(MULTIPLY_NUMBERS):
+				NUMBER_OPERATION(MULTIPLY, *);
+				NEXT;
+			INSTRUCTION(EQUAL_NUMBERS):
+				NUMBER_OPERATION(EQUAL, ==);
+				NEXT;
+			INSTRUCTION(LESS_NUMBERS):
+				NUMBER_OPERATION(LESS, <);
+				NEXT;
+			INSTRUCTION(GREATER_NUMBERS):
+				NUMBER_OPERATION(GREATER, >);
+				NEXT;
+			INSTRUCTION(NOT): {
+				Value val = POP();
+				PUSH(Value(!truth_value(val)));
+				}
+				NEXT;
+			INSTRUCTION(TRUE):
+				PUSH(Value(true));
+				NEXT;
+			INSTRUCTION(FALSE):
+				PUSH(Value(false));
+				NEXT;
+			INSTRUCTION(NIL):
+				PUSH(Value(value_type::NIL));
+				NEXT;
+			INSTRUCTION(POP):
+				--sp;
+				NEXT;
+			INSTRUCTION(RETURN): {
+				Value result = POP();
 
 				if (frames.size() == 1) {
-					stack_pop();
+					// An inlined let leaves its locals open until the end.
+					close_last_frame_upvalues();
+					stack_top = slots;
 					frames.pop_back();
 					std::cout << result.print() << '\n';
 					return interpret_result::OK;
 				}
 
 				close_last_frame_upvalues();
-				stack.erase(stack.begin() + frames.back().stack_index, stack.end());
-				stack.push_back(result);
+				stack_top = slots;
+				stack_push(result);
 				frames.pop_back();
+				LOAD_FRAME();
+				}
+				NEXT;
+			// Superinstructions - each behaves as its pair of instructions.
+			INSTRUCTION(GET_LOCAL_CONSTANT): {
+				size_t local = read_uint16_and_update_ip(ip);
+				size_t index = read_uint16_and_update_ip(ip);
+				PUSH(slots[local + 1]);
+				PUSH(constants[index]);
+				}
+				NEXT;
+			INSTRUCTION(GET_LOCAL_LOCAL): {
+				size_t first = read_uint16_and_update_ip(ip);
+				size_t second = read_uint16_and_update_ip(ip);
+				PUSH(slots[first + 1]);
+				PUSH(slots[second + 1]);
+				}
+				NEXT;
+			INSTRUCTION(GET_GLOBAL_LOCAL): {
+				size_t index = read_uint16_and_update_ip(ip);
+				size_t local = read_uint16_and_update_ip(ip);
+				PUSH_GLOBAL(index);
+				PUSH(slots[local + 1]);
+				}
+				NEXT;
+			INSTRUCTION(POP_GET_LOCAL): {
+				size_t local = read_uint16_and_update_ip(ip);
+				sp[-1] = slots[local + 1];
+				}
+				NEXT;
+			INSTRUCTION(POP_GET_GLOBAL): {
+				size_t index = read_uint16_and_update_ip(ip);
+				--sp;
+				PUSH_GLOBAL(index);
+				}
+				NEXT;
+			INSTRUCTION(JUMP_IF_FALSE_POP): {
+				size_t jump = read_uint16_and_update_ip(ip);
+				if (PEEK(0).match_type(value_type::BOOL) &&
+					PEEK(0).as_boolean() == false)
+					ip += jump;
+				else
+					--sp;
+				}
+				NEXT;
+			INSTRUCTION(GET_LOCAL_0):
+				PUSH(slots[1]);
+				NEXT;
+			INSTRUCTION(GET_LOCAL_1):
+				PUSH(slots[2]);
+				NEXT;
+			INSTRUCTION(GET_LOCAL_2):
+				PUSH(slots[3]);
+				NEXT;
+			INSTRUCTION(GET_LOCAL_3):
+				PUSH(slots[4]);
+				NEXT;
+			INSTRUCTION(GET_LOCAL_SHORT): {
+				size_t index = *ip++;
+				PUSH(slots[index + 1]);
 				}
-				break;
-			default:
+				NEXT;
+			INSTRUCTION(GET_GLOBAL_SHORT): {
+				size_t index = *ip++;
+				PUSH_GLOBAL(index);
+				}
+				NEXT;
+			INSTRUCTION(CONSTANT_SHORT):
+				PUSH(constants[*ip++]);
+				NEXT;
+			INSTRUCTION(SMALL_INT):
+				PUSH(Value(static_cast<double>(static_cast<int8_t>(*ip++))));
+				NEXT;
+			INSTRUCTION(WIDE): {
+				// Rare, so one handler decodes the instruction after the prefix.
+				uint8_t op = *ip++;
+				size_t operand = read_uint32_and_update_ip(ip);
+				switch (op) {
+					case opcode::CONSTANT:
+						PUSH(constants[operand]);
+						break;
+					case opcode::DEFINE_GLOBAL:
+					case opcode::SET_GLOBAL:
+						POP_GLOBAL(operand);
+						break;
+					case opcode::GET_GLOBAL:
+						PUSH_GLOBAL(operand);
+						break;
+					case opcode::GET_LOCAL:
+						PUSH(slots[operand + 1]);
+						break;
+					case opcode::SET_LOCAL:
+						slots[operand + 1] = POP();
+						break;
+					case opcode::GET_UPVALUE:
+						PUSH(*upvalues[operand]->location);
+						break;
+					case opcode::SET_UPVALUE:
+						*upvalues[operand]->location = POP();
+						break;
+					case opcode::GET_CAPTURED:
+						PUSH(captures[operand]);
+						break;
+					case opcode::JUMP:
+						ip += operand;
+						break;
+					case opcode::JUMP_IF_FALSE:
+						if (PEEK(0).match_type(value_type::BOOL) && PEEK(0).as_boolean() == false)
+							ip += operand;
+						break;
+					case opcode::JUMP_IF_TRUE:
+						if (!PEEK(0).match_type(value_type::BOOL) || PEEK(0).as_boolean() == true)
+							ip += operand;
+						break;
+					case opcode::JUMP_IF_FALSE_POP:
+						if (PEEK(0).match_type(value_type::BOOL) && PEEK(0).as_boolean() == false)
+							ip += operand;
+						else
+							--sp;
+						break;
+					case opcode::LOOP:
+						LOOP_TO_START(operand);
+						break;
+					case opcode::END_SCOPE:
+						LEAVE_SCOPE(operand);
+						break;
+					case opcode::CLOSURE:
+						MAKE_CLOSURE(operand, read_uint32_and_update_ip);
+						break;
+					default:
+						return interpret_result::RUNTIME_ERROR;
+				}
+				}
+				NEXT;
+			UNKNOWN_INSTRUCTION:
 				return interpret_result::RUNTIME_ERROR;
 		}
 	}
 }
 
+#undef TRACE_INSTRUCTION
+#undef INSTRUCTION
+#undef UNKNOWN_INSTRUCTION
+#undef DISPATCH
+#undef NEXT
+#undef LOAD_FRAME
+#undef STORE_FRAME
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef PUSH_GLOBAL
+#undef POP_GLOBAL
+#undef CALL_SITE
+#undef BINARY_OPERATION
+#undef NUMBER_OPERATION
+#undef LOOP_TO_START
+#undef LEAVE_SCOPE
+#undef MAKE_CLOSURE
+
 /**
  * Mark the roots of the garbage collector readability graph.
  */
 void
 VirtualMachine::gc_mark_roots() {
-	for (auto& i : stack) memory.gc_mark(i);
+	for (Value* i = stack.data(); i < stack_top; i++) memory.gc_mark(*i);
 	for (auto& i : globals) memory.gc_mark(i);
+	for (auto& i : primitives) if (i.builtin != nullptr) memory.gc_mark(i.builtin);
 	for (auto& i : frames) memory.gc_mark(i.closure);
+	for (auto i = open_upvalues; i != nullptr; i = i->next_open) memory.gc_mark(i);
 }
 
 // TODO: different file?
 
 /**
- * Store a heap-allocated object in memory, returning its representation as a
- * Value. Collect garbage if necessary.
+ * Start tracking a newly allocated object so that it can be garbage collected.
+ * Collect garbage first if necessary - the new object is not collected.
  * 
- * @param object: Data to be stored in memory.
- * @return: Value with pointer to object.
+ * @param object: object to track.
  */
-Value
-Memory::allocate(Data object) {
+void
+Memory::track(Data* object) {
 #ifdef DEBUG_STRESS_GC
 	if (gc_active) collect_garbage();
 #else
-	gc_size += object.size();
+	gc_size += object->size();
 	if (gc_active && gc_size > gc_threshold) {
 		gc_size = collect_garbage();
 		gc_threshold = gc_size *2;
 	}
 #endif
 
-	memory.push_front(object);
+	object->next = objects;
+	objects = object;
 
 #ifdef DEBUG_LOG_GC
-	std::cerr << "ALLOCATE " << object.print() << "\n";
+	std::cerr << "ALLOCATE " << object->print() << "\n";
 #endif
+}
+
+/**
+ * Delete an object, using its type to find the right destructor.
+ * 
+ * @param object: object to delete.
+ */
+void
+Memory::free(Data* object)
+{
+	switch (object->type) {
+		case data_type::PAIR:
+			delete object->cast<Pair>();
+			break;
+		case data_type::FUNCTION:
+			delete object->cast<Function>();
+			break;
+		case data_type::BUILTIN:
+			delete object->cast<BuiltinFunction>();
+			break;
+		case data_type::CLOSURE:
+			delete object->cast<Closure>();
+			break;
+		case data_type::STRING:
+			delete object->cast<String>();
+			break;
+		case data_type::UPVALUE:
+			delete object->cast<RuntimeUpvalue>();
+			break;
+	}
+}
 
-	return Value(&memory.front());
+/**
+ * Free everything still in memory.
+ */
+Memory::~Memory()
+{
+	while (objects != nullptr) {
+		Data* next = objects->next;
+		free(objects);
+		objects = next;
+	}
 }
 
 /**
@@ -569,15 +1454,21 @@ Memory::collect_garbage() {
 	// Mark
 	vm.gc_mark_roots();
 	while (gc_worklist.size() > 0) advance_worklist();
+	vm.optimizer().constants().sweep();  // Recompilation info is weak.
+	vm.gc_sweep_lazy();
 
-	// Sweep
-	memory.remove_if([](auto& d) { return !d.reachable; });
-
-	// Reset for next mark operation
+	// Sweep, and reset for next mark operation
 	size_t new_size = 0;
-	for (auto& d : memory) {
-		d.reachable = false;
-		new_size += d.size();
+	for (Data** link = &objects; *link != nullptr;) {
+		Data* object = *link;
+		if (!object->reachable) {
+			*link = object->next;
+			free(object);
+			continue;
+		}
+		object->reachable = false;
+		new_size += object->size();
+		link = &object->next;
 	}
 
 #ifdef DEBUG_LOG_GC
@@ -598,26 +1489,30 @@ Memory::advance_worklist()
 
 	switch (next->type) {
 		case data_type::UPVALUE:
-			using upvalue_p = std::shared_ptr<RuntimeUpvalue>;
-			gc_mark(next->cast<upvalue_p>()->data);
+			gc_mark(next->cast<RuntimeUpvalue>()->closed);
 			break;
 		case data_type::FUNCTION:
-			using function_p = std::shared_ptr<Function>;
-			for (auto& i : next->cast<function_p>()->bytecode.constants) {
+			for (auto& i : next->cast<Function>()->bytecode.constants) {
 				gc_mark(i);
 			}
+			// Cached callees are kept alive - at most CACHE_SIZE per call site.
+			for (auto& site : next->cast<Function>()->bytecode.call_sites) {
+				for (size_t i = 0; i < site.size; i++) gc_mark(site.entries[i].target);
+			}
 			break;
 		case data_type::CLOSURE:
-			using closure_p = std::shared_ptr<Closure>;
-			gc_mark(next->cast<closure_p>()->function);
-			for (auto& i : next->cast<closure_p>()->upvalues) {
-				gc_mark(i->data);
+			gc_mark(next->cast<Closure>()->function);
+			for (auto& i : next->cast<Closure>()->upvalues) {
+				gc_mark(i);
+			}
+			for (auto& i : next->cast<Closure>()->captures) {
+				gc_mark(i);
 			}
 			break;
 		case data_type::PAIR: {
 			auto pair = next->cast<Pair>();
-			gc_mark(pair.car);
-			gc_mark(pair.cdr);
+			gc_mark(pair->car);
+			gc_mark(pair->cdr);
 			}
 			break;
 		default:
@@ -633,7 +1528,7 @@ Memory::advance_worklist()
 void
 Memory::gc_mark(Value val)
 {
-	if (val.type == value_type::DATA) gc_mark(val.as.data);
+	if (val.match_type(value_type::DATA)) gc_mark(val.as_data());
 }
 
 /**
@@ -655,15 +1550,18 @@ Memory::gc_mark(Data* data)
 }
 
 /**
- * Mark all data directly reachable from this closure.
- * 
- * @param clos: reachable closure - mark upvalues.
+ * Close all upvalues for stack slots at or above a slot.
+ *
+ * @param last: lowest slot to close upvalues for.
  */
 void
-Memory::gc_mark(std::shared_ptr<Closure> clos)
+VirtualMachine::close_upvalues(Value* last)
 {
-	for (auto& i : clos->upvalues) {
-		gc_mark(i->data);
+	while (open_upvalues != nullptr && open_upvalues->location >= last) {
+		RuntimeUpvalue* upvalue = open_upvalues;
+		upvalue->closed = *upvalue->location;
+		upvalue->location = &upvalue->closed;
+		open_upvalues = upvalue->next_open;
 	}
 }
 
@@ -673,12 +1571,5 @@ Memory::gc_mark(std::shared_ptr<Closure> clos)
 void
 VirtualMachine::close_last_frame_upvalues()
 {
-	auto end = open_upvalues.rend();
-	size_t removed = 0;
-	for (auto i = open_upvalues.rbegin(); i != end; i++) {
-		if ((*i)->index < frames.back().stack_index) break;
-		(*i)->data = stack[(*i)->index];
-		removed++;
-	}
-	open_upvalues.erase(std::prev(open_upvalues.end(), removed), open_upvalues.end());
+	close_upvalues(stack.data() + frames.back().stack_index);
 }
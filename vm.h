@@ -6,9 +6,10 @@
 #include "value.h"
 #include "debug.h"
 #include "function.h"
+#include "optimizer.h"
 
-constexpr size_t RECURSION_MAX = 64;
-constexpr size_t STACK_MAX = 256 * RECURSION_MAX;
+constexpr size_t RECURSION_MAX = 8192;
+constexpr size_t STACK_MAX = 32 * RECURSION_MAX;
 
 // TODO: correct return process for blank line
 
@@ -21,10 +22,13 @@ enum class interpret_result {
 // TODO: index instead of pointer
 /**
  * Call with closure being executed, instruction being executed, and location
- * of frame on stack (starting at index of the closure).
+ * of frame on stack (starting at index of the closure). The closure's function
+ * and bytecode are resolved once when the frame is created.
  */
 struct CallFrame {
-	std::shared_ptr<Closure> closure;  // env?
+	Closure* closure;  // env?
+	Function* function;
+	Chunk* chunk;
 	uint8_t* ip;
 	size_t stack_index;
 };
@@ -34,19 +38,67 @@ struct CallFrame {
  */
 class Memory {
 	VirtualMachine& vm;
-	std::forward_list<Data> memory;
+	Data* objects = nullptr;  // Every allocated object, linked through Data::next.
 	std::queue<Data*> gc_worklist;
 	void advance_worklist();
 	size_t collect_garbage();
+	void track(Data* object);
+	void free(Data* object);
 	size_t gc_threshold = 4;
 	size_t gc_size = 0;
 public:
 	bool gc_active = false;
-	Value allocate(Data object);
+	template <typename T, typename... Args>
+	T* allocate(Args&&... args);
 	void gc_mark(Value val);
 	void gc_mark(Data* data);
-	void gc_mark(std::shared_ptr<Closure> clos);
+	/**
+	 * Visit every object currently allocated.
+	 * 
+	 * @param visit: called with each object's Data header.
+	 */
+	template <typename F>
+	void for_each(F visit) {
+		for (Data* object = objects; object != nullptr; object = object->next) visit(object);
+	}
 	Memory(VirtualMachine& vm) : vm{ vm } {};
+	~Memory();
+};
+
+/**
+ * Store a heap-allocated object in memory. Collect garbage if necessary.
+ * 
+ * @param args: arguments passed to the constructor of T.
+ * @return: pointer to the new object.
+ */
+template <typename T, typename... Args>
+T*
+Memory::allocate(Args&&... args)
+{
+	T* object = new T(std::forward<Args>(args)...);
+	track(object);
+	return object;
+}
+
+/**
+ * Operator that the compiler turns into its own opcode. The opcode only takes
+ * its fast path while the operator's global still holds the original builtin.
+ */
+struct Primitive
+{
+	size_t global = 0;
+	Data* builtin = nullptr;
+};
+
+/**
+ * Function whose body the compiler left to be compiled on its first call,
+ * with what is needed to compile it - see Compiler::defer_body.
+ */
+struct LazyFunction
+{
+	std::unique_ptr<Lambda> node;  // Lazy lambda, without the names found in its body.
+	std::vector<std::string> captured = {};  // Names of upvalues, in order.
+	std::vector<bool> copied = {};  // Is each upvalue copied into the closure?
 };
 
 /**
@@ -55,38 +107,79 @@ public:
 class VirtualMachine {
 private:
 	interpret_result run();
+	// Allocated once with STACK_MAX slots - stack_top is one past the top.
 	std::vector<Value> stack;
+	Value* stack_top;
 	std::vector<CallFrame> frames;
 	Memory memory{ *this };
+	PassManager passes{ *this };
 
-	// TODO: benchmark map performance here too
-	std::list<std::shared_ptr<RuntimeUpvalue>> open_upvalues;
+	// Sorted by stack slot, highest first.
+	RuntimeUpvalue* open_upvalues = nullptr;
 	// TODO: benchmark vector vs. map performance here
 	// Hybrid solution - string-index map, value vector globals
 	std::unordered_map<std::string, size_t> global_indexes;
 	std::vector<Value> globals;
+	// Indexed by opcode - only set for operators with their own opcode.
+	Primitive primitives[opcode::OPCODE_COUNT];
+	std::unordered_map<std::string, uint8_t> primitive_opcodes;
+	// Globals below this index may hold operators - see POP_GLOBAL.
+	size_t operator_globals = 0;
+	bool operators_intact = true;  // Have the operators never been rebound?
+	std::unordered_map<Function*, LazyFunction> lazy_functions;
+#ifdef PROFILE_OPCODE_PAIRS
+	// Indexed by previous opcode, then opcode - see PROFILE_INSTRUCTION.
+	size_t opcode_pairs[opcode::OPCODE_COUNT][opcode::OPCODE_COUNT] = {};
+	uint8_t previous_opcode = opcode::RETURN;
+#endif
+	void stack_push(Value value);
 	Value stack_pop();
 	Value stack_peek(size_t depth);
+	void stack_reset();
 	void runtime_error(std::string message, size_t line);
 	bool truth_value(Value val);
 	uint16_t read_uint16_and_update_ip(uint8_t*& ip);  // TODO: move this to util?
+	uint32_t read_uint32_and_update_ip(uint8_t*& ip);
 	bool call(size_t number_arguments);
-	bool call(const std::shared_ptr<Closure> function, size_t number_arguments);
-	bool call(std::shared_ptr<BuiltinFunction> function, size_t number_arguments);
-	std::shared_ptr<RuntimeUpvalue> capture_upvalue(size_t index);
-	void disassemble_current_instruction(size_t line);
+	bool call(Closure* closure, size_t number_arguments);
+	bool call(BuiltinFunction* function, size_t number_arguments);
+	bool push_frame(Closure* closure, size_t number_arguments);
+	bool compile_lazy(Function* function);
+	void arity_error(size_t arity, size_t number_arguments);
+	CallSite::Entry* record_call(CallSite& site, Value* callee, size_t number_arguments);
+	bool call_site(size_t site, uint8_t* instruction, size_t number_arguments);
+	void quicken_call(uint8_t* instruction, Value callee);
+	bool primitive_intact(uint8_t op);
+	bool primitives_intact();
+	bool call_primitive(uint8_t op);
+	RuntimeUpvalue* capture_upvalue(Value* local);
+	void trace_instruction(uint8_t* ip, size_t& line);
+	void close_upvalues(Value* last);
 	void close_last_frame_upvalues();
-	void global_builtin(std::shared_ptr<BuiltinFunction> builtin);
+	void global_builtin(BuiltinFunction* builtin);
+	void global_primitive(BuiltinFunction* builtin, uint8_t op);
 public:
 	interpret_result interpret(std::string& source);
-	Value allocate(std::string string);
-	Value allocate(std::shared_ptr<Function> function);
-	Value allocate(std::shared_ptr<Closure> closure);
-	Value allocate(std::shared_ptr<BuiltinFunction> builtin);
-	Value allocate(Pair pair);
+	/**
+	 * Allocate an object of type T in runtime memory.
+	 * 
+	 * @param args: arguments passed to the constructor of T.
+	 * @return: pointer to the new object.
+	 */
+	template <typename T, typename... Args>
+	T* allocate(Args&&... args) {
+		return memory.allocate<T>(std::forward<Args>(args)...);
+	}
 	size_t global(const std::string key);
-	bool check_global(const std::string key);
+	bool check_global(const std::string& key);
+	int primitive_opcode(const std::string key);
+	BuiltinFunction* pure_builtin(const std::string key);
+	void defer(Function* function, LazyFunction body);
 	void gc_mark_roots();
+	void gc_sweep_lazy();
+	void print_call_sites();
+	void print_opcode_pairs();
+	PassManager& optimizer() { return passes; }
 	VirtualMachine();
 };
 